@@ -33,6 +33,48 @@
  *
  * The first approach is most useful in simple or short running NEAs. The second, and especially third, approaches are more useful in longer running or complex NEAs.
  *
+ * ## Helpers
+ *
+ * napi_helpers.h provides header-only conveniences implemented on top of the functions in this file:
+ *
+ * - napi::Receiver receives messages into a buffer it owns and grows, so the NEA never has to handle napi::GetOutcome::bufferTooSmall.
+ * - napi::get_batch (napiGetBatch in C) receives every message NAPI has ready into one buffer in a single call.
+ * - napi::put_batch sends a JSON array or newline delimited stream of messages, with an outcome for each.
+ * - napi::Dispatcher implements the third approach: it generates the `exchange` for each request and delivers the response to a future or handler.
+ * - napi::Dispatcher::request_all sends several operations for a band together and completes when all of them have.
+ * - napi::Priority::background requests are held by the dispatcher and sent a few at a time, round-robin across bands, so interactive
+ *   requests are not queued behind bulk work; napi::Dispatcher::schedule reports the depth of each class.
+ * - napi::Dispatcher::subscribe gives each set of paths, such as roaming authentication nonces, its own queue with its own capacity
+ *   and napi::Overflow policy, so memory stays bounded during a storm of notifications. Responses are never discarded.
+ * - napi::Queue::keep_latest_per_band keeps only the latest presence-change and found-change notification for each band.
+ * - napi::Dispatcher::snapshot reads the latest presence, found and RSSI state of every band from memory, without an `info/get` round trip.
+ * - napi::Snapshot::changed_since reports only the bands that changed since a given snapshot epoch and version.
+ * - napi::ProvisionLog turns each `provisions/changed` notification into a napi::ProvisionDelta, so the NEA can persist a base snapshot
+ *   and a log of deltas rather than rewriting every provision on every change.
+ * - napi::Queue::fd lets a dispatcher queue be waited on in a select/poll/epoll/kqueue event loop instead of a dedicated thread (not available on Windows).
+ * - napi::Queue::get_for waits for a message with a timeout, and napi::Queue::interrupt wakes its waiters so consumers can stop without napi::terminate.
+ * - napi::async makes a dispatcher request awaitable from a C++20 coroutine, with a timeout and a choice of where the coroutine resumes.
+ * - napi::sign_batch has the band sign the root of a Merkle tree over many hashes with one `sign/run`; napi_merkle.h, which does not
+ *   need NAPI, gives each item's inclusion proof and checks it.
+ * - napi::random_bytes obtains any number of bytes of band entropy in one call, and napi::EntropyPool fetches it ahead of time for each
+ *   band so it can be taken from memory.
+ * - napi::Dispatcher::stats reports latency histograms for each path, split into time in NAPI before the band and time with the band;
+ *   napi::Queue::high_water and napi::Queue::latency report the depth of a queue and how long its messages waited.
+ * - napi::Dispatcher::trace records when each request reaches each napi::Stage in a ring buffer, and napi::chrome_trace exports it for
+ *   chrome://tracing.
+ * - napi::Dispatcher::cancel_all ends every waiting request at once, so a restart does not wait for NAPI to finish its operations in flight.
+ * - napi::Queue recycles the buffers its consumers give back, clearing them first, so receiving through a queue does not allocate per message.
+ *
+ * ## Threads
+ *
+ * The helpers assume that napi::put may be called from several threads at once, and at the same time as napi::get or napi::try_get is
+ * called on another thread, and that each message from NAPI is returned to only one caller of napi::get or napi::try_get. This library does
+ * not state either guarantee itself, so an NEA that makes neither assumption should call napi::put from one thread at a time and receive on a
+ * single thread. napi::Dispatcher receives on its own thread and hands the messages on, and calls napi::put from the threads making requests.
+ *
+ * Of the helpers, napi::Queue, napi::Dispatcher and napi::EntropyPool may be used from any number of threads; napi::Receiver and
+ * napi::ProvisionLog belong to one thread at a time.
+ *
  * ## Coordinating napi::get and napi::configure
  *
  * It is not possible for napi::get to succeed before napi::configure has completed successfully. During the startup phase napi::get will return
@@ -43,7 +85,11 @@
  * \note
  * -# The time between the first successful call to napi::get and napi::configure does not matter, no messages are dropped.
  * -# napi::configure should only be called once.
+ * -# There is one NAPI per process. To serve bands through several networked hosts or Nymulators, run an NEA process for each `host` and `port`.
  * -# Restarting NAPI is achieved by calling napi::terminate() followed by another call to napi::configure.
+ * -# A restart is not needed to change which notifications are sent; use `notifications/set` while NAPI is running.
+ * -# napi::terminate waits for operations in flight. An NEA using napi::Dispatcher can call napi::Dispatcher::cancel_all first so its own
+ *    threads are released at once.
  * -# Errors that occur during NAPI startup may be reported as a general error notification. These are obtained by calling napi::get.
  *
  * ## Logs
@@ -54,6 +100,9 @@
  *
  * The log files are crated in the config directory specified in napi::configure
  *
+ * To look into timing problems without raising the log level, use napi::Dispatcher::trace and napi::Dispatcher::stats from napi_helpers.h.
+ * They record only paths, exchange numbers and times in memory, never message content, so they can be left on in a deployed NEA.
+ *
  * \warning
  * - Logs are written to the filesystem in **clear text**.
  * - All log levels, other than `LogLevel::normal`, write sensitive material, such as symmetric keys, to the log in **clear text**.
@@ -244,11 +293,12 @@ namespace napi{
    * For most NEAs the default arguments are correct, so the call would be similar to `napi::configure("root-directory-path");`.
    * The default host of `""` is treated as `"127.0.0.1"`. The default port of -1 will choose the port depending on platform (OS X or Windows) and libary (native or networked).
    *
-   * The value of `provisions` should be the same as the last saved value.
+   * The value of `provisions` should be the same as the last saved value. napi::ProvisionLog::provisions rebuilds that value from a saved base and a log of changes.
    *
    * \note
    * -# This should only be called once for every run of the NEA.
    * -# Restarting NAPI is achieved by calling napi::terminate() followed by another call to napi::configure.
+   * -# Which notifications are sent can be changed without a restart, with `notifications/set`.
    */
   API ConfigOutcome configure( const char* neaName,
                                const char* logDirectory,
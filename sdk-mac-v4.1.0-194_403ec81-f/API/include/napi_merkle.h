@@ -0,0 +1,261 @@
+/*! \file napi_merkle.h
+ * \brief Merkle trees for signing many hashes with one `sign/run`, and verifying the result.
+ *
+ * A Nymi Band signs one 32 byte SHA256 hash per `sign/run`. To sign N hashes with a single round trip to the band the NEA
+ * builds a Merkle tree over them, has the band sign the root (see napi::sign_batch in napi_helpers.h), and hands each
+ * item its inclusion proof. Anyone holding an item's hash, its proof and the signed root can check that the item was
+ * covered by the signature: recompute the root with napi::merkle::verify, then verify the band's ECDSA signature over
+ * that root with the band's `verificationkey` (NIST256P or SECP256K, as chosen by `sign/setup`).
+ *
+ * Leaves and interior nodes are hashed with distinct prefixes (as in RFC 6962) so an interior node can never be passed
+ * off as a leaf. A node without a sibling is promoted to the next level unchanged.
+ *
+ * This header does not depend on NAPI, so verifiers can use it on their own.
+ */
+
+#pragma once
+#ifndef JSON_NAPI_MERKLE_X
+#define JSON_NAPI_MERKLE_X
+
+#ifdef __cplusplus
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace napi{
+namespace merkle{
+
+  /**
+   * \brief A SHA256 hash.
+   */
+  typedef std::array< unsigned char, 32 > Digest;
+
+  /**
+   * \brief Incremental SHA256 (FIPS 180-4).
+   */
+  class Sha256{
+    public:
+      Sha256(){
+        static const std::uint32_t initial[ 8 ] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                                    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+        std::memcpy( state_, initial, sizeof( state_ ) );
+      }
+
+      Sha256& update( const void* data, std::size_t len ){
+        const unsigned char* p = static_cast< const unsigned char* >( data );
+        length_ += len;
+        while( len > 0 ){
+          std::size_t n = 64 - used_ < len ? 64 - used_ : len;
+          std::memcpy( block_ + used_, p, n );
+          used_ += n;
+          p += n;
+          len -= n;
+          if( used_ == 64 ){
+            compress();
+            used_ = 0;
+          }
+        }
+        return *this;
+      }
+
+      Digest digest(){
+        std::uint64_t bits = length_ * 8;
+        unsigned char pad = 0x80;
+        update( &pad, 1 );
+        pad = 0;
+        while( used_ != 56 ) update( &pad, 1 );
+        unsigned char size[ 8 ];
+        for( int i = 0; i < 8; ++i ) size[ i ] = static_cast< unsigned char >( bits >> ( 56 - 8 * i ) );
+        update( size, 8 );
+        Digest out;
+        for( int i = 0; i < 32; ++i ) out[ i ] = static_cast< unsigned char >( state_[ i / 4 ] >> ( 24 - 8 * ( i % 4 ) ) );
+        return out;
+      }
+
+    private:
+      static std::uint32_t rotate( std::uint32_t x, int n ){ return ( x >> n ) | ( x << ( 32 - n ) ); }
+
+      void compress(){
+        static const std::uint32_t k[ 64 ] = {
+          0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+          0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+          0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+          0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+          0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+          0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+          0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+          0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+        std::uint32_t w[ 64 ];
+        for( int i = 0; i < 16; ++i ){
+          w[ i ] = std::uint32_t( block_[ 4 * i ] ) << 24 | std::uint32_t( block_[ 4 * i + 1 ] ) << 16 |
+                   std::uint32_t( block_[ 4 * i + 2 ] ) << 8 | std::uint32_t( block_[ 4 * i + 3 ] );
+        }
+        for( int i = 16; i < 64; ++i ){
+          std::uint32_t s0 = rotate( w[ i - 15 ], 7 ) ^ rotate( w[ i - 15 ], 18 ) ^ ( w[ i - 15 ] >> 3 );
+          std::uint32_t s1 = rotate( w[ i - 2 ], 17 ) ^ rotate( w[ i - 2 ], 19 ) ^ ( w[ i - 2 ] >> 10 );
+          w[ i ] = w[ i - 16 ] + s0 + w[ i - 7 ] + s1;
+        }
+        std::uint32_t a = state_[ 0 ], b = state_[ 1 ], c = state_[ 2 ], d = state_[ 3 ];
+        std::uint32_t e = state_[ 4 ], f = state_[ 5 ], g = state_[ 6 ], h = state_[ 7 ];
+        for( int i = 0; i < 64; ++i ){
+          std::uint32_t t1 = h + ( rotate( e, 6 ) ^ rotate( e, 11 ) ^ rotate( e, 25 ) ) + ( ( e & f ) ^ ( ~e & g ) ) + k[ i ] + w[ i ];
+          std::uint32_t t2 = ( rotate( a, 2 ) ^ rotate( a, 13 ) ^ rotate( a, 22 ) ) + ( ( a & b ) ^ ( a & c ) ^ ( b & c ) );
+          h = g;
+          g = f;
+          f = e;
+          e = d + t1;
+          d = c;
+          c = b;
+          b = a;
+          a = t1 + t2;
+        }
+        state_[ 0 ] += a;
+        state_[ 1 ] += b;
+        state_[ 2 ] += c;
+        state_[ 3 ] += d;
+        state_[ 4 ] += e;
+        state_[ 5 ] += f;
+        state_[ 6 ] += g;
+        state_[ 7 ] += h;
+      }
+
+      std::uint32_t state_[ 8 ];
+      unsigned char block_[ 64 ];
+      std::size_t used_ = 0;
+      std::uint64_t length_ = 0;
+  };
+
+  /**
+   * \brief The SHA256 hash of `len` bytes at `data`.
+   */
+  inline Digest sha256( const void* data, std::size_t len ){ return Sha256().update( data, len ).digest(); }
+
+  /**
+   * \brief The hash of a leaf of the tree.
+   */
+  inline Digest leaf( const Digest& hash ){
+    const unsigned char prefix = 0;
+    return Sha256().update( &prefix, 1 ).update( hash.data(), hash.size() ).digest();
+  }
+
+  /**
+   * \brief The hash of an interior node of the tree.
+   */
+  inline Digest node( const Digest& left, const Digest& right ){
+    const unsigned char prefix = 1;
+    return Sha256().update( &prefix, 1 ).update( left.data(), left.size() ).update( right.data(), right.size() ).digest();
+  }
+
+  /**
+   * \brief One step from a node towards the root: the node's sibling and which side the sibling is on.
+   */
+  struct Step{
+      Digest sibling; //!< The hash of the sibling node.
+      bool left; //!< True if the sibling is the left child.
+  };
+
+  /**
+   * \brief The steps from a leaf to the root, proving the leaf is included under the root.
+   */
+  typedef std::vector< Step > Proof;
+
+  /**
+   * \brief A Merkle tree over a list of SHA256 hashes.
+   */
+  class Tree{
+    public:
+      /**
+       * \param[in] hashes the hashes to sign, at least one
+       */
+      explicit Tree( const std::vector< Digest >& hashes ){
+        levels_.emplace_back();
+        for( const Digest& hash : hashes ) levels_.back().push_back( leaf( hash ) );
+        while( levels_.back().size() > 1 ){
+          const std::vector< Digest >& below = levels_.back();
+          std::vector< Digest > above;
+          for( std::size_t i = 0; i < below.size(); i += 2 ){
+            above.push_back( i + 1 < below.size() ? node( below[ i ], below[ i + 1 ] ) : below[ i ] );
+          }
+          levels_.push_back( std::move( above ) );
+        }
+      }
+
+      /**
+       * \brief The root of the tree, the hash the band signs.
+       */
+      const Digest& root() const{ return levels_.back().front(); }
+
+      /**
+       * \brief The number of hashes in the tree.
+       */
+      std::size_t size() const{ return levels_.front().size(); }
+
+      /**
+       * \brief The inclusion proof of the hash at `index`.
+       */
+      Proof proof( std::size_t index ) const{
+        Proof steps;
+        for( std::size_t level = 0; level + 1 < levels_.size(); ++level, index /= 2 ){
+          std::size_t sibling = index ^ 1;
+          if( sibling < levels_[ level ].size() ) steps.push_back( Step{ levels_[ level ][ sibling ], sibling < index } );
+        }
+        return steps;
+      }
+
+    private:
+      std::vector< std::vector< Digest > > levels_;
+  };
+
+  /**
+   * \brief The root that `hash` and `proof` lead to.
+   */
+  inline Digest root( const Digest& hash, const Proof& proof ){
+    Digest current = leaf( hash );
+    for( const Step& step : proof ) current = step.left ? node( step.sibling, current ) : node( current, step.sibling );
+    return current;
+  }
+
+  /**
+   * \brief Whether `proof` shows that `hash` is included under `root`.
+   *
+   * The signature over `root` must still be checked against the band's verification key.
+   */
+  inline bool verify( const Digest& hash, const Proof& proof, const Digest& root ){
+    return merkle::root( hash, proof ) == root;
+  }
+
+  /**
+   * \brief A hash as lower case hexadecimal, the form used in `sign/run`.
+   */
+  inline std::string hex( const Digest& digest ){
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    for( unsigned char byte : digest ){
+      out += digits[ byte >> 4 ];
+      out += digits[ byte & 15 ];
+    }
+    return out;
+  }
+
+  /**
+   * \brief Read a hash from 64 hexadecimal digits.
+   */
+  inline bool from_hex( const std::string& literal, Digest* digest ){
+    if( literal.size() != 64 ) return false;
+    for( std::size_t i = 0; i < 64; ++i ){
+      char c = literal[ i ];
+      int value = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+      if( value < 0 ) return false;
+      ( *digest )[ i / 2 ] = static_cast< unsigned char >( i % 2 ? ( ( *digest )[ i / 2 ] | value ) : value << 4 );
+    }
+    return true;
+  }
+}
+}
+
+#endif // __cplusplus
+#endif // JSON_NAPI_MERKLE_X
@@ -0,0 +1,408 @@
+/*! \file napi_helpers_test.cpp
+ * \brief Tests of napi_helpers.h against an in-memory stand-in for NAPI.
+ *
+ * The stand-in below replaces the NAPI library: napi::put records each request, napi::get and napi::try_get return
+ * the messages given to deliver(), and napi::terminate ends the current napi::get. No Nymi Band is needed.
+ *
+ * Build and run from this directory with
+ *
+ *     c++ -std=c++11 -pthread -I../include napi_helpers_test.cpp -o napi_helpers_test && ./napi_helpers_test
+ *
+ * The program prints each failed check and exits with a nonzero status if any failed.
+ */
+
+#include "napi_helpers.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace{
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque< std::string > incoming;
+  std::vector< std::string > requests;
+  bool running = false;
+  bool terminating = false;
+  bool waiting = false;
+
+  int failures = 0;
+
+#define CHECK( condition ) \
+  do{ if( !( condition ) ){ ++failures; std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition "\n"; } }while( false )
+
+  // give a message to the next napi::get
+  void deliver( const std::string& json ){
+    std::lock_guard< std::mutex > lock( mutex );
+    incoming.push_back( json );
+    changed.notify_all();
+  }
+
+  // wait until the dispatcher has handled every delivered message and is waiting for another
+  void settle(){
+    std::unique_lock< std::mutex > lock( mutex );
+    changed.wait( lock, []{ return incoming.empty() && waiting; } );
+  }
+
+  std::size_t put_count(){
+    std::lock_guard< std::mutex > lock( mutex );
+    return requests.size();
+  }
+
+  // wait until napi::put has been called `count` times
+  void wait_for_puts( std::size_t count ){
+    std::unique_lock< std::mutex > lock( mutex );
+    changed.wait( lock, [ count ]{ return requests.size() >= count; } );
+  }
+
+  std::string member_of_put( std::size_t i, const char* object, const char* name ){
+    std::string json;
+    {
+      std::lock_guard< std::mutex > lock( mutex );
+      if( i < requests.size() ) json = requests[ i ];
+    }
+    const char* p = json.data();
+    const char* end = p + json.size();
+    if( object && !napi::detail::find_member( json.data(), json.data() + json.size(), object, &p, &end ) ) return std::string();
+    std::string value;
+    napi::detail::string_member( p, end, name, &value );
+    return value;
+  }
+
+  std::string exchange_of_put( std::size_t i ){ return member_of_put( i, nullptr, "exchange" ); }
+
+  std::string pid_of_put( std::size_t i ){ return member_of_put( i, "request", "pid" ); }
+
+  // the final response to the request put `i`-th
+  void answer( std::size_t i ){ deliver( "{\"completed\":true,\"exchange\":\"" + exchange_of_put( i ) + "\",\"response\":{}}" ); }
+
+  std::string request_for( const char* path, const std::string& pid ){
+    return std::string( "{\"path\":\"" ) + path + "\",\"request\":{\"pid\":\"" + pid + "\"}}";
+  }
+
+  void start(){
+    napi::configure( "napi_helpers_test", "." );
+    std::lock_guard< std::mutex > lock( mutex );
+    incoming.clear();
+    requests.clear();
+  }
+
+}
+
+namespace napi{
+
+  std::ostream& operator<<( std::ostream& os, const Path v ){ return os << static_cast< int >( v ); }
+
+  ConfigOutcome configure( const char*, const char*, const char*, LogLevel, int, const char* ){
+    std::lock_guard< std::mutex > lock( mutex );
+    running = true;
+    terminating = false;
+    return ConfigOutcome::okay;
+  }
+
+  PutOutcome put( const char* json_in ){
+    if( *json_in != '{' ) return PutOutcome::unparseableJSON;
+    std::lock_guard< std::mutex > lock( mutex );
+    if( !running ) return PutOutcome::notRunning;
+    requests.push_back( json_in );
+    changed.notify_all();
+    return PutOutcome::okay;
+  }
+
+  PutOutcome put( Path, const char* json_in ){ return put( json_in ); }
+
+  GetOutcome get( char* buffer, unsigned long long max, unsigned long long* len ){
+    std::unique_lock< std::mutex > lock( mutex );
+    waiting = true;
+    changed.notify_all();
+    changed.wait( lock, []{ return !incoming.empty() || terminating || !running; } );
+    waiting = false;
+    if( terminating ){
+      terminating = false;
+      running = false;
+      return GetOutcome::terminated;
+    }
+    if( !running ) return GetOutcome::notRunning;
+    *len = incoming.front().size();
+    if( *len > max ) return GetOutcome::bufferTooSmall;
+    std::memcpy( buffer, incoming.front().data(), *len );
+    incoming.pop_front();
+    return GetOutcome::okay;
+  }
+
+  TryGetOutcome try_get( char* buffer, unsigned long long max, unsigned long long* len ){
+    std::lock_guard< std::mutex > lock( mutex );
+    if( terminating ){
+      terminating = false;
+      running = false;
+      return TryGetOutcome::terminated;
+    }
+    if( !running ) return TryGetOutcome::notRunning;
+    if( incoming.empty() ) return TryGetOutcome::nothing;
+    *len = incoming.front().size();
+    if( *len > max ) return TryGetOutcome::bufferTooSmall;
+    std::memcpy( buffer, incoming.front().data(), *len );
+    incoming.pop_front();
+    return TryGetOutcome::okay;
+  }
+
+  bool translateLiteralPath( const char* literal, Path* path ){
+    static const std::map< std::string, Path > paths = {
+      { "info/get", Path::InfoGet },
+      { "random/run", Path::RandomRun },
+      { "totp/get", Path::TOTPGet },
+      { "notifications/report/presence-change", Path::EventOnPresenceChangeData },
+      { "notifications/report/found-change", Path::EventOnFoundChangeData },
+    };
+    auto found = paths.find( literal );
+    if( found == paths.end() ) return false;
+    *path = found->second;
+    return true;
+  }
+
+  void terminate(){
+    std::lock_guard< std::mutex > lock( mutex );
+    terminating = true;
+    changed.notify_all();
+  }
+
+}
+
+namespace{
+
+  // responses go to their request whatever order they arrive in, interim messages do not end a request, and
+  // everything else goes to a subscriber or the dispatcher's queue
+  void routing_and_interim(){
+    start();
+    {
+      napi::Dispatcher dispatcher;
+      std::shared_ptr< napi::Queue > presence = dispatcher.subscribe( { napi::Path::EventOnPresenceChangeData } );
+      std::future< napi::Response > first, second;
+      CHECK( dispatcher.request( napi::Path::InfoGet, "{\"path\":\"info/get\"}", &first ) == napi::PutOutcome::okay );
+      CHECK( dispatcher.request( napi::Path::InfoGet, "{\"path\":\"info/get\"}", &second ) == napi::PutOutcome::okay );
+      CHECK( put_count() == 2 && exchange_of_put( 0 ) != exchange_of_put( 1 ) );
+
+      deliver( "{\"completed\":false,\"exchange\":\"" + exchange_of_put( 0 ) + "\",\"path\":\"info/get\",\"tracking\":\"1\"}" );
+      deliver( "{\"completed\":true,\"exchange\":\"" + exchange_of_put( 1 ) + "\",\"path\":\"info/get\",\"response\":{\"n\":2}}" );
+      settle();
+      CHECK( first.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::timeout );
+      napi::Response response = second.get();
+      CHECK( response.outcome == napi::RequestOutcome::okay && response.json.find( "\"n\":2" ) != std::string::npos );
+      napi::Stats stats = dispatcher.stats();
+      CHECK( stats.interim == 1 && stats.pending == 1 && stats.received == 2 );
+
+      answer( 0 );
+      CHECK( first.get().outcome == napi::RequestOutcome::okay );
+      CHECK( dispatcher.stats().pending == 0 );
+
+      std::string json;
+      deliver( "{\"completed\":true,\"path\":\"notifications/report/presence-change\",\"response\":{}}" );
+      deliver( "{\"completed\":true,\"exchange\":\"someone-else\",\"response\":{}}" );
+      settle();
+      CHECK( presence->try_get( &json ) == napi::TryGetOutcome::okay && json.find( "presence-change" ) != std::string::npos );
+      CHECK( presence->try_get( &json ) == napi::TryGetOutcome::nothing );
+      CHECK( dispatcher.queue()->try_get( &json ) == napi::TryGetOutcome::okay && json.find( "someone-else" ) != std::string::npos );
+      CHECK( dispatcher.queue()->try_get( &json ) == napi::TryGetOutcome::nothing );
+      napi::terminate();
+    }
+  }
+
+  void cancel_timeout_terminate(){
+    start();
+    {
+      napi::Dispatcher dispatcher;
+      std::string exchange;
+      std::promise< napi::RequestOutcome > cancelled;
+      CHECK( dispatcher.request( napi::Path::InfoGet, "{}", [ &cancelled ]( const napi::Response& r ){ cancelled.set_value( r.outcome ); },
+                                 0, &exchange ) == napi::PutOutcome::okay );
+      CHECK( dispatcher.cancel( exchange ) );
+      CHECK( !dispatcher.cancel( exchange ) );
+      CHECK( cancelled.get_future().get() == napi::RequestOutcome::cancelled );
+      // the late response of a cancelled request is passed on like any other message
+      answer( 0 );
+      settle();
+      std::string json;
+      CHECK( dispatcher.queue()->try_get( &json ) == napi::TryGetOutcome::okay && json.find( exchange ) != std::string::npos );
+
+      std::future< napi::Response > timed, left;
+      CHECK( dispatcher.request( napi::Path::InfoGet, "{}", &timed, 20 ) == napi::PutOutcome::okay );
+      CHECK( timed.get().outcome == napi::RequestOutcome::timedOut );
+
+      CHECK( dispatcher.request( napi::Path::InfoGet, "{}", &left ) == napi::PutOutcome::okay );
+      CHECK( dispatcher.stats().pending == 1 );
+      napi::terminate();
+      CHECK( left.get().outcome == napi::RequestOutcome::terminated );
+      CHECK( dispatcher.queue()->get( &json ) == napi::GetOutcome::terminated );
+      std::future< napi::Response > late;
+      CHECK( dispatcher.request( napi::Path::InfoGet, "{}", &late ) != napi::PutOutcome::okay );
+    }
+  }
+
+  // background requests are sent a window at a time, taking each band in turn, while interactive requests bypass the window
+  void window_and_round_robin(){
+    start();
+    {
+      napi::Dispatcher dispatcher;
+      std::vector< std::future< napi::Response > > responses( 7 );
+      const char* pids[] = { "a", "a", "a", "b", "b", "c" };
+      for( int i = 0; i < 6; ++i ){
+        CHECK( dispatcher.request( napi::Path::TOTPGet, request_for( "totp/get", pids[ i ] ).c_str(), &responses[ i ], napi::Priority::background )
+               == napi::PutOutcome::okay );
+      }
+      napi::Schedule schedule = dispatcher.schedule();
+      CHECK( schedule.background == 1 && schedule.held == 5 && schedule.pids[ "a" ] == 2 && schedule.released == 1 );
+      CHECK( put_count() == 1 && pid_of_put( 0 ) == "a" );
+
+      CHECK( dispatcher.request( napi::Path::InfoGet, "{\"path\":\"info/get\"}", &responses[ 6 ] ) == napi::PutOutcome::okay );
+      CHECK( put_count() == 2 && dispatcher.schedule().interactive == 1 );
+      answer( 1 );
+      responses[ 6 ].get();
+      CHECK( dispatcher.schedule().interactive == 0 );
+
+      std::string order = pid_of_put( 0 );
+      answer( 0 );
+      for( std::size_t i = 2; i < 7; ++i ){
+        wait_for_puts( i + 1 );
+        order += pid_of_put( i );
+        answer( i );
+      }
+      CHECK( order == "abcaba" );
+      for( std::size_t i = 0; i < 6; ++i ) CHECK( responses[ i ].get().outcome == napi::RequestOutcome::okay );
+      schedule = dispatcher.schedule();
+      CHECK( schedule.background == 0 && schedule.held == 0 && schedule.interactive == 0 && schedule.released == 6 );
+
+      // a timed out request keeps its place until NAPI answers it, or until the abandon timeout
+      dispatcher.abandon_timeout( 60000 );
+      std::future< napi::Response > abandoned, next;
+      CHECK( dispatcher.request( napi::Path::TOTPGet, request_for( "totp/get", "a" ).c_str(), &abandoned, napi::Priority::background, 20 )
+             == napi::PutOutcome::okay );
+      CHECK( dispatcher.request( napi::Path::TOTPGet, request_for( "totp/get", "b" ).c_str(), &next, napi::Priority::background )
+             == napi::PutOutcome::okay );
+      CHECK( abandoned.get().outcome == napi::RequestOutcome::timedOut );
+      schedule = dispatcher.schedule();
+      CHECK( schedule.abandoned == 1 && schedule.held == 1 && put_count() == 8 );
+      answer( 7 );
+      wait_for_puts( 9 );
+      CHECK( pid_of_put( 8 ) == "b" && dispatcher.schedule().abandoned == 0 );
+
+      // cancel_all ends everything, including the places of abandoned requests
+      std::future< napi::Response > held;
+      CHECK( dispatcher.request( napi::Path::TOTPGet, request_for( "totp/get", "c" ).c_str(), &held, napi::Priority::background )
+             == napi::PutOutcome::okay );
+      CHECK( dispatcher.cancel_all() == 2 );
+      CHECK( next.get().outcome == napi::RequestOutcome::cancelled && held.get().outcome == napi::RequestOutcome::cancelled );
+      schedule = dispatcher.schedule();
+      CHECK( schedule.background == 0 && schedule.held == 0 && schedule.abandoned == 0 && schedule.pids.empty() );
+      napi::terminate();
+    }
+  }
+
+  std::string info( double rssi_a, double rssi_b ){
+    return "{\"completed\":true,\"path\":\"info/get\",\"response\":{\"nymiband\":["
+           "{\"RSSI_smoothed\":" + std::to_string( rssi_a ) + ",\"found\":\"authenticated\",\"present\":\"yes\",\"provisioned\":{\"pid\":\"a\"}},"
+           "{\"RSSI_smoothed\":" + std::to_string( rssi_b ) + ",\"present\":\"no\",\"provisioned\":{\"pid\":\"b\"}}]}}";
+  }
+
+  void snapshot_versions(){
+    start();
+    {
+      napi::Dispatcher dispatcher;
+      std::vector< std::size_t > rows;
+      CHECK( dispatcher.snapshot()->version == 0 );
+      deliver( info( -50, -60 ) );
+      settle();
+      std::shared_ptr< const napi::Snapshot > snapshot = dispatcher.snapshot();
+      CHECK( snapshot->version == 1 && snapshot->changed_since( 0, 0, &rows ) && rows.size() == 2 );
+      CHECK( snapshot->present_and_authenticated( "a" ) && !snapshot->present_and_authenticated( "b" ) );
+
+      // an identical report changes nothing
+      deliver( info( -50, -60 ) );
+      settle();
+      CHECK( dispatcher.snapshot() == snapshot );
+
+      deliver( info( -50, -61 ) );
+      settle();
+      std::shared_ptr< const napi::Snapshot > later = dispatcher.snapshot();
+      CHECK( later->version == 2 && later->epoch == snapshot->epoch );
+      CHECK( later->changed_since( later->epoch, 1, &rows ) && rows.size() == 1 && rows[ 0 ] == 1 );
+      CHECK( snapshot->version == 1 && snapshot->RSSI_smoothed[ 1 ] == -60 );
+      // a version from another table cannot be compared, so every row is reported
+      CHECK( !later->changed_since( later->epoch + 1, 1, &rows ) && rows.size() == 2 );
+
+      deliver( "{\"completed\":true,\"path\":\"notifications/report/presence-change\",\"event\":{\"pid\":\"b\",\"after\":\"yes\"}}" );
+      settle();
+      CHECK( dispatcher.snapshot()->version == 3 && dispatcher.snapshot()->present[ 1 ] == napi::Presence::yes );
+      napi::terminate();
+    }
+  }
+
+  std::string presence_change( const char* pid, int n ){
+    return std::string( "{\"completed\":true,\"path\":\"notifications/report/presence-change\",\"event\":{\"pid\":\"" ) + pid
+           + "\",\"after\":\"yes\",\"n\":" + std::to_string( n ) + "}}";
+  }
+
+  void queue_overflow(){
+    std::string json;
+    start();
+    {
+      napi::Dispatcher dispatcher( 2, napi::Overflow::dropOldest );
+      std::string response = "{\"completed\":true,\"exchange\":\"someone-else\",\"response\":{}}";
+      deliver( response );
+      for( int n = 0; n < 3; ++n ) deliver( presence_change( "a", n ) );
+      settle();
+      const std::shared_ptr< napi::Queue >& queue = dispatcher.queue();
+      CHECK( queue->size() == 2 && queue->dropped() == 2 && queue->high_water() == 2 );
+      // responses are never dropped
+      CHECK( queue->try_get( &json ) == napi::TryGetOutcome::okay && json == response );
+      CHECK( queue->try_get( &json ) == napi::TryGetOutcome::okay && json.find( "\"n\":2" ) != std::string::npos );
+      napi::terminate();
+    }
+    start();
+    {
+      napi::Dispatcher dispatcher( 2, napi::Overflow::coalesce );
+      const char* pids[] = { "a", "b", "a", "a" };
+      for( int n = 0; n < 4; ++n ) deliver( presence_change( pids[ n ], n ) );
+      settle();
+      const std::shared_ptr< napi::Queue >& queue = dispatcher.queue();
+      CHECK( queue->size() == 2 && queue->coalesced() == 2 && queue->dropped() == 0 );
+      // a coalesced notification keeps the place of the one it replaces
+      CHECK( queue->try_get( &json ) == napi::TryGetOutcome::okay && json.find( "\"n\":3" ) != std::string::npos );
+      CHECK( queue->try_get( &json ) == napi::TryGetOutcome::okay && json.find( "\"n\":1" ) != std::string::npos );
+      napi::terminate();
+      CHECK( queue->get( &json ) == napi::GetOutcome::terminated );
+    }
+    // a full subscriber drops its own messages without holding up the dispatcher
+    start();
+    {
+      napi::Dispatcher dispatcher;
+      std::shared_ptr< napi::Queue > presence = dispatcher.subscribe( { napi::Path::EventOnPresenceChangeData }, 1 );
+      for( int n = 0; n < 3; ++n ) deliver( presence_change( "a", n ) );
+      deliver( "{\"completed\":true,\"path\":\"notifications/report/found-change\",\"response\":{}}" );
+      settle();
+      CHECK( presence->size() == 1 && presence->dropped() == 2 );
+      CHECK( dispatcher.queue()->try_get( &json ) == napi::TryGetOutcome::okay && json.find( "found-change" ) != std::string::npos );
+      napi::terminate();
+    }
+  }
+
+}
+
+int main(){
+  routing_and_interim();
+  cancel_timeout_terminate();
+  window_and_round_robin();
+  snapshot_versions();
+  queue_overflow();
+  if( failures ) std::cerr << failures << " checks failed\n";
+  else std::cout << "all checks passed\n";
+  return failures ? 1 : 0;
+}
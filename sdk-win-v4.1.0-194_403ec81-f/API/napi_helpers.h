@@ -0,0 +1,2771 @@
+/*! \file napi_helpers.h
+ * \brief Header-only conveniences built on the NAPI C++ entry points.
+ *
+ * Everything in this file is implemented inline on top of napi::put, napi::get and napi::try_get (and their C
+ * equivalents) -- it does not require anything from NAPI beyond what is declared in napi.h.
+ */
+
+#pragma once
+#ifndef JSON_NAPI_HELPERS_X
+#define JSON_NAPI_HELPERS_X
+
+#include "napi.h"
+#include "napi_merkle.h"
+
+#ifdef __cplusplus
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#if __has_include(<stop_token>)
+#include <optional>
+#include <stop_token>
+#endif
+#endif
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+#endif
+
+namespace napi{
+
+  ///@private
+  namespace detail{
+
+    // A minimal scanner over JSON text. It finds the extent of values without building anything, which is all the
+    // helpers need to frame and route messages; NAPI remains responsible for actually parsing them.
+
+    inline const char* skip_space( const char* p, const char* end ){
+      while( p < end && ( *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' ) ) ++p;
+      return p;
+    }
+
+    // p points at the opening quote, returns the position after the closing quote or nullptr
+    inline const char* skip_string( const char* p, const char* end ){
+      for( ++p; p < end; ++p ){
+        if( *p == '\\' ) ++p;
+        else if( *p == '"' ) return p + 1;
+      }
+      return nullptr;
+    }
+
+    // p points at the first character of a value, returns the position after the value or nullptr
+    inline const char* skip_value( const char* p, const char* end ){
+      if( p >= end ) return nullptr;
+      if( *p == '"' ) return skip_string( p, end );
+      if( *p == '{' || *p == '[' ){
+        unsigned depth = 0;
+        for( ; p < end; ++p ){
+          if( *p == '"' ){
+            p = skip_string( p, end );
+            if( !p ) return nullptr;
+            --p;
+          }
+          else if( *p == '{' || *p == '[' ) ++depth;
+          else if( ( *p == '}' || *p == ']' ) && --depth == 0 ) return p + 1;
+        }
+        return nullptr;
+      }
+      const char* start = p;
+      while( p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r' ) ++p;
+      return p == start ? nullptr : p;
+    }
+
+    // finds the member `key` of the object starting at p, setting [*value, *value_end) to the extent of its value
+    inline bool find_member( const char* p, const char* end, const char* key, const char** value, const char** value_end ){
+      p = skip_space( p, end );
+      if( p >= end || *p != '{' ) return false;
+      std::size_t length = std::strlen( key );
+      for( p = skip_space( p + 1, end ); p < end && *p == '"'; ){
+        const char* name_end = skip_string( p, end );
+        if( !name_end ) return false;
+        bool match = std::size_t( name_end - p - 2 ) == length && std::memcmp( p + 1, key, length ) == 0;
+        p = skip_space( name_end, end );
+        if( p >= end || *p != ':' ) return false;
+        p = skip_space( p + 1, end );
+        const char* next = skip_value( p, end );
+        if( !next ) return false;
+        if( match ){
+          *value = p;
+          *value_end = next;
+          return true;
+        }
+        p = skip_space( next, end );
+        if( p < end && *p == ',' ) p = skip_space( p + 1, end );
+      }
+      return false;
+    }
+
+    // the raw (still escaped) contents of the string member `key`
+    inline bool string_member( const char* p, const char* end, const char* key, std::string* out ){
+      const char* value;
+      const char* value_end;
+      if( !find_member( p, end, key, &value, &value_end ) || *value != '"' ) return false;
+      out->assign( value + 1, value_end - 1 );
+      return true;
+    }
+
+    inline bool number_member( const char* p, const char* end, const char* key, double* out ){
+      const char* value;
+      const char* value_end;
+      if( !find_member( p, end, key, &value, &value_end ) ) return false;
+      std::string number( value, value_end );
+      char* parsed;
+      double d = std::strtod( number.c_str(), &parsed );
+      if( parsed == number.c_str() ) return false;
+      *out = d;
+      return true;
+    }
+
+    inline bool bool_member( const char* p, const char* end, const char* key, bool* out ){
+      const char* value;
+      const char* value_end;
+      if( !find_member( p, end, key, &value, &value_end ) ) return false;
+      *out = *value == 't';
+      return true;
+    }
+
+    // steps through the members of an object; start with *cursor at the opening brace
+    inline bool next_member( const char** cursor, const char* end, std::string* name, const char** value, const char** value_end ){
+      const char* p = skip_space( *cursor, end );
+      if( p < end && ( *p == '{' || *p == ',' ) ) p = skip_space( p + 1, end );
+      if( p >= end || *p != '"' ) return false;
+      const char* name_end = skip_string( p, end );
+      if( !name_end ) return false;
+      name->assign( p + 1, name_end - 1 );
+      p = skip_space( name_end, end );
+      if( p >= end || *p != ':' ) return false;
+      p = skip_space( p + 1, end );
+      const char* next = skip_value( p, end );
+      if( !next ) return false;
+      *value = p;
+      *value_end = next;
+      *cursor = next;
+      return true;
+    }
+
+    // NAPI has spelled the response member both ways
+    inline bool response_member( const char* p, const char* end, const char** value, const char** value_end ){
+      return find_member( p, end, "response", value, value_end ) || find_member( p, end, "Response", value, value_end );
+    }
+
+    // copies the object `json` into out with its exchange member set to `exchange`
+    inline bool with_exchange( const char* json, const std::string& exchange, std::string* out ){
+      const char* end = json + std::strlen( json );
+      const char* p = skip_space( json, end );
+      if( p >= end || *p != '{' || skip_value( p, end ) == nullptr ) return false;
+      const char* value;
+      const char* value_end;
+      if( find_member( p, end, "exchange", &value, &value_end ) ){
+        out->assign( json, value );
+        *out += '"' + exchange + '"';
+        out->append( value_end, end );
+        return true;
+      }
+      const char* body = skip_space( p + 1, end );
+      out->assign( json, p + 1 );
+      *out += "\"exchange\":\"" + exchange + '"';
+      if( *body != '}' ) *out += ',';
+      out->append( p + 1, end );
+      return true;
+    }
+
+    // messages NAPI sends on its own initiative, rather than in response to a request
+    inline bool is_notification( Path path ){
+      switch( path ){
+        case Path::EventOnFoundChangeData:
+        case Path::EventOnPresenceChangeData:
+        case Path::EventOnGeneralErrorData:
+        case Path::EventOnProvisionsChangedData:
+        case Path::EventOnLEDPatternChangeData:
+        case Path::EventOnProvisionedData:
+        case Path::EventRANonceData:
+          return true;
+        default:
+          return false;
+      }
+    }
+
+    // NAPI reports progress on a request with interim messages that are not complete and carry a tracking member
+    inline bool is_interim( const char* p, const char* end ){
+      const char* value;
+      const char* value_end;
+      return find_member( p, end, "completed", &value, &value_end )
+             && std::strncmp( value, "false", 5 ) == 0
+             && find_member( p, end, "tracking", &value, &value_end );
+    }
+  }
+
+  /**
+   * \brief Receives JSON messages from NAPI into storage owned by the receiver.
+   *
+   * napi::get copies each message into a buffer supplied by the NEA, and returns napi::GetOutcome::bufferTooSmall
+   * when that buffer cannot hold it. A Receiver keeps one buffer for its lifetime and grows it to the exact size NAPI
+   * reports, so after the largest message has been seen once every further message is received without a retry or an
+   * allocation. The NEA is handed a read-only view of the receiver's buffer instead of a copy of its own.
+   *
+   * The view returned by get or try_get is NUL terminated and remains valid until napi::Receiver::release, the next
+   * call to get or try_get, or the destruction of the receiver -- whichever comes first.
+   *
+   * \note
+   * A Receiver is not thread safe; use one receiver per consuming thread.
+   */
+  class Receiver{
+    public:
+      /**
+       * \param[in] initial the initial size of the receive buffer, it grows as needed.
+       */
+      explicit Receiver( unsigned long long initial = 4096 )
+        : buffer_( static_cast< std::vector< char >::size_type >( initial < 2 ? 2 : initial ) ){}
+
+      /**
+       * \brief Receive a JSON message from NAPI, blocks if nothing is available yet.
+       *
+       * \param[out] json set to a view of the received JSON (set only if the outcome is napi::GetOutcome::okay)
+       * \param[out] len the length of the received JSON, not counting the terminating NUL
+       *
+       * The outcome is never napi::GetOutcome::bufferTooSmall; otherwise it is the same as napi::get.
+       */
+      GetOutcome get( const char** json, unsigned long long* len ){
+        // a shorter message would leave the tail of the previous one in the buffer
+        release();
+        for( ;; ){
+          unsigned long long n = 0;
+          GetOutcome outcome = napi::get( buffer_.data(), capacity(), &n );
+          if( outcome == GetOutcome::bufferTooSmall ){
+            grow( n );
+            continue;
+          }
+          if( outcome == GetOutcome::okay ) lease( n, json, len );
+          return outcome;
+        }
+      }
+
+      /**
+       * \brief Receive a JSON message from NAPI if one is available, non-blocking.
+       *
+       * \param[out] json set to a view of the received JSON (set only if the outcome is napi::TryGetOutcome::okay)
+       * \param[out] len the length of the received JSON, not counting the terminating NUL
+       *
+       * The outcome is never napi::TryGetOutcome::bufferTooSmall; otherwise it is the same as napi::try_get.
+       */
+      TryGetOutcome try_get( const char** json, unsigned long long* len ){
+        // a shorter message would leave the tail of the previous one in the buffer
+        release();
+        for( ;; ){
+          unsigned long long n = 0;
+          TryGetOutcome outcome = napi::try_get( buffer_.data(), capacity(), &n );
+          if( outcome == TryGetOutcome::bufferTooSmall ){
+            grow( n );
+            continue;
+          }
+          if( outcome == TryGetOutcome::okay ) lease( n, json, len );
+          return outcome;
+        }
+      }
+
+      /**
+       * \brief End the lease on the last received message; its contents are overwritten.
+       *
+       * Responses can contain sensitive material such as symmetric keys, so the leased bytes are cleared rather than left
+       * in the buffer until the next message overwrites them.
+       */
+      void release(){
+        volatile char* p = buffer_.data();
+        for( unsigned long long i = 0; i < leased_; ++i ) p[ i ] = 0;
+        leased_ = 0;
+      }
+
+      /**
+       * \brief The current size of the receive buffer.
+       */
+      unsigned long long size() const{ return buffer_.size(); }
+
+      ~Receiver(){ release(); }
+
+    private:
+      Receiver( const Receiver& ) = delete;
+      Receiver& operator=( const Receiver& ) = delete;
+
+      // one byte is always held back for the terminating NUL
+      unsigned long long capacity() const{ return buffer_.size() - 1; }
+
+      void grow( unsigned long long required ){
+        release();
+        unsigned long long size = buffer_.size();
+        while( size < required + 1 ) size *= 2;
+        buffer_.assign( static_cast< std::vector< char >::size_type >( size ), 0 );
+      }
+
+      void lease( unsigned long long n, const char** json, unsigned long long* len ){
+        buffer_[ static_cast< std::vector< char >::size_type >( n ) ] = 0;
+        leased_ = n;
+        *json = buffer_.data();
+        *len = n;
+      }
+
+      std::vector< char > buffer_;
+      unsigned long long leased_ = 0;
+  };
+
+  /**
+   * \brief Receive as many JSON messages from NAPI as fit in one buffer, blocks until at least one is available.
+   *
+   * \param[in, out] arena a char* buffer, allocated by the NEA, into which the received JSON messages will be copied back to back.
+   * \param[in] max maximum length of arena
+   * \param[out] offsets the offset into arena of each received message
+   * \param[out] lengths the length of each received message
+   * \param[in] count the number of entries in offsets and lengths
+   * \param[out] received the number of messages copied into arena
+   * \param[out] next the length of the next message waiting in NAPI, or 0 if nothing is waiting
+   *
+   * The first message is received with napi::get, the rest with napi::try_get, so a batch never waits for more messages
+   * than NAPI already has ready. The batch ends when `count` messages have been received, when NAPI has nothing else
+   * waiting, or when the next message does not fit in what remains of arena. In every case `next` reports the size of
+   * the message left waiting so the NEA can size the following batch.
+   *
+   * The outcome is napi::GetOutcome::okay if at least one message was received. If NAPI terminates or stops part way
+   * through a batch the corresponding outcome is returned; the messages already received are still valid. If the first
+   * message does not fit in arena the outcome is napi::GetOutcome::bufferTooSmall and `next` holds its size.
+   *
+   * \note
+   * NAPI does not report how many messages it has queued; `next` only says whether another one is waiting.
+   */
+  inline GetOutcome get_batch( char* arena, unsigned long long max,
+                               unsigned long long* offsets, unsigned long long* lengths, unsigned long long count,
+                               unsigned long long* received, unsigned long long* next ){
+    *received = 0;
+    *next = 0;
+    if( count == 0 ) return GetOutcome::error;
+
+    unsigned long long len = 0;
+    GetOutcome first = napi::get( arena, max, &len );
+    if( first == GetOutcome::bufferTooSmall ) *next = len;
+    if( first != GetOutcome::okay ) return first;
+    offsets[ 0 ] = 0;
+    lengths[ 0 ] = len;
+    unsigned long long used = len;
+    *received = 1;
+
+    // once count is reached a zero length try_get reports the size of the next message without receiving it
+    for( ;; ){
+      bool full = *received == count;
+      len = 0;
+      TryGetOutcome outcome = napi::try_get( arena + used, full ? 0 : max - used, &len );
+      switch( outcome ){
+        case TryGetOutcome::okay:
+          if( full ) return GetOutcome::okay;
+          offsets[ *received ] = used;
+          lengths[ *received ] = len;
+          used += len;
+          ++*received;
+          continue;
+        case TryGetOutcome::bufferTooSmall:
+          *next = len;
+          return GetOutcome::okay;
+        case TryGetOutcome::nothing:
+          return GetOutcome::okay;
+        case TryGetOutcome::notRunning:
+          return GetOutcome::notRunning;
+        case TryGetOutcome::terminated:
+          return GetOutcome::terminated;
+        case TryGetOutcome::error:
+          return GetOutcome::error;
+      }
+      return GetOutcome::error;
+    }
+  }
+
+  /**
+   * \brief Send several JSON messages to NAPI
+   *
+   * \param[in] batch either a JSON array of messages, or messages separated by whitespace (such as newline delimited JSON)
+   * \return the outcome of napi::put for each message, in order
+   *
+   * The batch is framed in a single pass and each message is handed to napi::put. A message that is not a JSON object
+   * is reported as napi::PutOutcome::unparseableJSON without being sent. In newline delimited input a malformed
+   * message only affects its own line; in an array it ends the batch.
+   */
+  inline std::vector< PutOutcome > put_batch( const char* batch ){
+    std::vector< PutOutcome > outcomes;
+    std::string message;
+    const char* end = batch + std::char_traits< char >::length( batch );
+    const char* p = detail::skip_space( batch, end );
+    bool array = p < end && *p == '[';
+    if( array ) p = detail::skip_space( p + 1, end );
+
+    while( p < end && !( array && *p == ']' ) ){
+      const char* next = detail::skip_value( p, end );
+      if( !next || *p != '{' ){
+        outcomes.push_back( PutOutcome::unparseableJSON );
+        if( array ) break;
+        while( p < end && *p != '\n' ) ++p;
+        p = detail::skip_space( p, end );
+        continue;
+      }
+      message.assign( p, next );
+      outcomes.push_back( napi::put( message.c_str() ) );
+      p = detail::skip_space( next, end );
+      if( array && p < end && *p == ',' ) p = detail::skip_space( p + 1, end );
+    }
+    return outcomes;
+  }
+
+  /**
+   * \brief Represents how a request made through napi::Dispatcher ended.
+   *
+   */
+  enum class RequestOutcome{
+      okay, //!< The final response to the request has been returned in napi::Response::json.
+      terminated, //!< NAPI terminated before the request was answered.
+      cancelled, //!< The request was cancelled with napi::Dispatcher::cancel.
+      timedOut, //!< The request was not answered within its timeout.
+      notSent, //!< napi::put did not accept the request.
+  };
+
+  /**
+   * \brief The final response to a request made through napi::Dispatcher.
+   *
+   */
+  struct Response{
+      RequestOutcome outcome; //!< How the request ended.
+      std::string json; //!< The final JSON response, empty unless the outcome is napi::RequestOutcome::okay.
+  };
+
+  /**
+   * \brief The class of a request made through napi::Dispatcher, see napi::Dispatcher::request.
+   *
+   */
+  enum class Priority{
+      interactive, //!< Sent to NAPI at once, for operations a user is waiting on such as roaming authentication.
+      background, //!< Held by the dispatcher and sent a few at a time, taking each band in turn, for bulk work such as a `totp/get` sweep.
+  };
+
+  /**
+   * \brief The requests a napi::Dispatcher is waiting on, by class, see napi::Dispatcher::schedule.
+   *
+   */
+  struct Schedule{
+      unsigned long long interactive = 0; //!< Interactive requests sent to NAPI and waiting for their response.
+      unsigned long long background = 0; //!< Background requests sent to NAPI and waiting for their response.
+      unsigned long long abandoned = 0; //!< Of `background`, the requests cancelled or timed out that NAPI has not answered yet.
+      unsigned long long held = 0; //!< Background requests held by the dispatcher until there is room to send them.
+      std::map< std::string, unsigned long long > pids; //!< The number of held background requests for each pid.
+      std::string turn; //!< The pid of the last background request sent; the next one sent is for the following pid.
+      unsigned long long released = 0; //!< The number of background requests sent so far.
+  };
+
+  /**
+   * \brief A distribution of durations, counted in buckets of powers of two microseconds.
+   *
+   */
+  struct Histogram{
+      unsigned long long buckets[ 32 ] = {}; //!< buckets[ i ] counts the durations of at least 2^(i-1) and under 2^i microseconds; buckets[ 0 ] those under 1 microsecond, buckets[ 31 ] everything longer.
+      unsigned long long count = 0; //!< The number of durations.
+      unsigned long long total = 0; //!< The sum of the durations in microseconds.
+      unsigned long long max = 0; //!< The longest duration in microseconds.
+
+      /**
+       * \brief An upper bound in microseconds on the given fraction of the durations, for example 0.99 for the 99th percentile.
+       */
+      unsigned long long percentile( double fraction ) const{
+        double wanted = fraction * count;
+        unsigned long long seen = 0;
+        for( int i = 0; i < 32; ++i ){
+          seen += buckets[ i ];
+          if( seen > 0 && seen >= wanted ) return i < 31 && ( 1ull << i ) < max ? 1ull << i : max;
+        }
+        return max;
+      }
+  };
+
+  ///@private
+  namespace detail{
+    // fills a histogram from any thread with relaxed atomics, so recording costs a few uncontended increments
+    class Recorder{
+      public:
+        void record( std::chrono::steady_clock::duration elapsed ){
+          long long count = std::chrono::duration_cast< std::chrono::microseconds >( elapsed ).count();
+          unsigned long long micros = count > 0 ? static_cast< unsigned long long >( count ) : 0;
+          int bucket = 0;
+          while( bucket < 31 && ( micros >> bucket ) != 0 ) ++bucket;
+          buckets_[ bucket ].fetch_add( 1, std::memory_order_relaxed );
+          count_.fetch_add( 1, std::memory_order_relaxed );
+          total_.fetch_add( micros, std::memory_order_relaxed );
+          unsigned long long max = max_.load( std::memory_order_relaxed );
+          while( micros > max && !max_.compare_exchange_weak( max, micros, std::memory_order_relaxed ) ){}
+        }
+
+        Histogram read() const{
+          Histogram histogram;
+          for( int i = 0; i < 32; ++i ) histogram.buckets[ i ] = buckets_[ i ].load( std::memory_order_relaxed );
+          histogram.count = count_.load( std::memory_order_relaxed );
+          histogram.total = total_.load( std::memory_order_relaxed );
+          histogram.max = max_.load( std::memory_order_relaxed );
+          return histogram;
+        }
+
+      private:
+        std::atomic< unsigned long long > buckets_[ 32 ] = {};
+        std::atomic< unsigned long long > count_{ 0 };
+        std::atomic< unsigned long long > total_{ 0 };
+        std::atomic< unsigned long long > max_{ 0 };
+    };
+  }
+
+  /**
+   * \brief The latencies of the answered requests with one path made through a napi::Dispatcher.
+   *
+   */
+  struct Latencies{
+      Histogram accepted; //!< From napi::put to NAPI's first progress message (see `tracking`), the time NAPI held the request before starting it with the band.
+      Histogram band; //!< From the first progress message to the final response, the radio and the band including any confirmation by the user.
+      Histogram total; //!< From napi::put to the final response.
+  };
+
+  /**
+   * \brief Counters and latencies of a napi::Dispatcher, see napi::Dispatcher::stats.
+   *
+   */
+  struct Stats{
+      std::map< Path, Latencies > paths; //!< The latencies of each path with at least one answered request.
+      Histogram held; //!< How long napi::Priority::background requests were held by the dispatcher before being put.
+      unsigned long long received = 0; //!< The number of messages received from NAPI.
+      unsigned long long interim = 0; //!< The number of progress messages received for requests.
+      unsigned long long pending = 0; //!< The number of requests waiting for their final response.
+  };
+
+  /**
+   * \brief A point in the life of a request made through napi::Dispatcher, see napi::Dispatcher::trace.
+   *
+   */
+  enum class Stage{
+      held, //!< A napi::Priority::background request was held by the dispatcher.
+      put, //!< napi::put accepted the request.
+      progress, //!< A progress message (see `tracking`) arrived for the request; NAPI has started it with the band.
+      response, //!< The final response arrived.
+      delivered, //!< The request's handler returned, or its future was given the response.
+      ended, //!< The request ended without a response: it was cancelled, timed out, not sent, or NAPI terminated.
+  };
+
+  /**
+   * \brief One stage of one request, see napi::Dispatcher::trace.
+   *
+   */
+  struct TraceEvent{
+      unsigned long long exchange; //!< The number N in the request's `exchange`, napi-dispatch-N.
+      Path path; //!< The path of the request.
+      Stage stage; //!< The stage reached.
+      std::chrono::steady_clock::time_point at; //!< When the stage was reached.
+  };
+
+  /**
+   * \brief Trace events as Chrome trace-event JSON, for chrome://tracing or Perfetto.
+   *
+   * Each request is drawn on its own row as the spans between its stages: "held" (by the dispatcher), "in NAPI" (before
+   * the band), "with band" and "handler".
+   */
+  inline std::string chrome_trace( std::vector< TraceEvent > events ){
+    std::stable_sort( events.begin(), events.end(), []( const TraceEvent& a, const TraceEvent& b ){
+      return a.exchange != b.exchange ? a.exchange < b.exchange : a.at < b.at;
+    } );
+    static const char* const spans[] = { "held", "in NAPI", "with band", "handler", "", "" };
+    std::ostringstream out;
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    for( std::size_t i = 0; i < events.size(); ++i ){
+      const TraceEvent& event = events[ i ];
+      long long at = std::chrono::duration_cast< std::chrono::microseconds >( event.at.time_since_epoch() ).count();
+      std::ostringstream path;
+      path << event.path;
+      const char* name = spans[ static_cast< int >( event.stage ) ];
+      bool next = i + 1 < events.size() && events[ i + 1 ].exchange == event.exchange;
+      if( event.stage == Stage::ended ) name = "ended";
+      else if( !next || !*name ) continue;
+      out << ( first ? "" : "," ) << "{\"name\":\"" << name << "\",\"cat\":\"" << path.str() << "\",\"pid\":1,\"tid\":" << event.exchange
+          << ",\"ts\":" << at;
+      if( event.stage == Stage::ended ) out << ",\"ph\":\"i\",\"s\":\"t\"";
+      else out << ",\"ph\":\"X\",\"dur\":" << std::chrono::duration_cast< std::chrono::microseconds >( events[ i + 1 ].at - event.at ).count();
+      out << ",\"args\":{\"exchange\":\"napi-dispatch-" << event.exchange << "\"}}";
+      first = false;
+    }
+    out << "]}";
+    return out.str();
+  }
+
+  /**
+   * \brief The presence state of a Nymi Band, see `notifications/report/presence-change` in the NAPI JSON Reference.
+   *
+   */
+  enum class Presence{
+      unknown, //!< NAPI has not reported the presence of the band.
+      yes, //!< received an advertisement from the Nymi Band within the last 5 seconds
+      likely, //!< received an advertisement from the Nymi Band within the last 15 seconds
+      unlikely, //!< received an advertisement from the Nymi Band within the last 60 seconds
+      no, //!< not received an advertisement from the Nymi Band for more than 60 seconds
+  };
+
+  /**
+   * \brief The found state of a Nymi Band, see `notifications/report/found-change` in the NAPI JSON Reference.
+   *
+   */
+  enum class Found{
+      unknown, //!< NAPI has not reported the found state of the band.
+      undetected, //!< undetected (normally occurs when the Nymi Band 'walks away')
+      unclasped, //!< unclasped (does not occur until after the Nymi Band has been authenticated)
+      unprovisionable, //!< unable to be provisioned, normally because the Nymi Band is fully provisioned
+      anonymous, //!< not provisioned by this NEA
+      discovered, //!< in provisioning mode
+      provisioning, //!< in the process of being provisioned
+      identified, //!< claiming to be a provisioned band but this has not been confirmed
+      authenticated, //!< confirmed as provisioned with this NEA
+  };
+
+  /**
+   * \brief The state of every provisioned band NAPI has reported, as seen by napi::Dispatcher.
+   *
+   * The table is stored as one array per attribute, indexed by row; napi::Snapshot::find gives the row of a pid. A
+   * snapshot is immutable once published, so it can be read from any thread without locking. Attributes NAPI has not yet
+   * reported for a band hold napi::Presence::unknown, napi::Found::unknown, or 0.
+   *
+   * Presence and found state come from presence-change and found-change notifications, so those notifications must be
+   * enabled with `notifications/set`. RSSI, queued commands and the authentication window come from `info/get`
+   * responses and provisioned notifications.
+   */
+  struct Snapshot{
+      unsigned long long epoch = 0; //!< Identifies the dispatcher that keeps the table; no two dispatchers in a process share an epoch.
+      unsigned long long version = 0; //!< Incremented each time the table changes, starting from 0 in each epoch.
+      std::vector< std::string > pid; //!< The provision id of each band.
+      std::vector< Presence > present; //!< The latest presence state of each band.
+      std::vector< Found > found; //!< The latest found state of each band.
+      std::vector< unsigned char > authenticated; //!< Non-zero if the band can be treated as authenticated.
+      std::vector< double > RSSI_smoothed; //!< The smoothed RSSI of each band.
+      std::vector< double > authenticationWindowRemaining; //!< Seconds remaining in each band's authentication window, when last reported.
+      std::vector< unsigned long long > commandsQueued; //!< The number of commands NAPI has queued for each band.
+      std::vector< unsigned long long > changed; //!< The version in which each row last changed.
+
+      /**
+       * \brief The row of the band with provision id `band`, or -1 if the band is not in the table.
+       */
+      long long find( const std::string& band ) const{
+        auto entry = index.find( band );
+        return entry == index.end() ? -1 : static_cast< long long >( entry->second );
+      }
+
+      /**
+       * \brief The rows that changed after version `since`, for following the table incrementally.
+       *
+       * \param[in] epoch_seen the epoch of the last snapshot the NEA has seen, 0 for none
+       * \param[in] since the version of the last snapshot the NEA has seen, 0 for none
+       * \param[out] rows the rows changed in versions after `since`
+       * \return false if `epoch_seen` and `since` do not name a version of this table (for example they came from a dispatcher
+       *         that has since been replaced, whose versions also start from 0); every row is then reported and the NEA
+       *         should resynchronize from scratch
+       *
+       * Rows are only marked as changed when a value in them changes, so repeating `info/get` for bands whose state is
+       * the same does not report them again.
+       */
+      bool changed_since( unsigned long long epoch_seen, unsigned long long since, std::vector< std::size_t >* rows ) const{
+        rows->clear();
+        bool known = ( epoch_seen == epoch && since <= version ) || ( epoch_seen == 0 && since == 0 );
+        for( std::size_t row = 0; row < changed.size(); ++row ){
+          if( !known || changed[ row ] > since ) rows->push_back( row );
+        }
+        return known;
+      }
+
+      /**
+       * \brief Whether the band is present (napi::Presence::yes) and authenticated.
+       */
+      bool present_and_authenticated( const std::string& band ) const{
+        long long row = find( band );
+        return row >= 0 && present[ row ] == Presence::yes && authenticated[ row ];
+      }
+
+      ///@private
+      std::unordered_map< std::string, std::size_t > index;
+  };
+
+  ///@private
+  namespace detail{
+
+    inline Presence presence( const std::string& literal ){
+      if( literal == "yes" ) return Presence::yes;
+      if( literal == "likely" ) return Presence::likely;
+      if( literal == "unlikely" ) return Presence::unlikely;
+      if( literal == "no" ) return Presence::no;
+      return Presence::unknown;
+    }
+
+    inline Found found( const std::string& literal ){
+      static const char* const literals[] = { "undetected", "unclasped", "unprovisionable", "anonymous", "discovered",
+                                              "provisioning", "identified", "authenticated" };
+      for( unsigned i = 0; i < sizeof( literals ) / sizeof( literals[ 0 ] ); ++i ){
+        if( literal == literals[ i ] ) return static_cast< Found >( i + 1 );
+      }
+      return Found::unknown;
+    }
+
+    template< typename Value, typename Source >
+    inline void update( Value& field, Source value, bool* modified ){
+      if( field == static_cast< Value >( value ) ) return;
+      field = static_cast< Value >( value );
+      *modified = true;
+    }
+
+    // the row for pid, added if the band is new
+    inline std::size_t row( Snapshot* table, const std::string& pid, bool* modified ){
+      auto found = table->index.find( pid );
+      if( found != table->index.end() ) return found->second;
+      *modified = true;
+      std::size_t row = table->pid.size();
+      table->index.emplace( pid, row );
+      table->pid.push_back( pid );
+      table->present.push_back( Presence::unknown );
+      table->found.push_back( Found::unknown );
+      table->authenticated.push_back( 0 );
+      table->RSSI_smoothed.push_back( 0 );
+      table->authenticationWindowRemaining.push_back( 0 );
+      table->commandsQueued.push_back( 0 );
+      table->changed.push_back( 0 );
+      return row;
+    }
+
+    // an empty table with an epoch no other table in the process has
+    inline Snapshot fresh_table(){
+      static std::atomic< unsigned long long > epochs{ 0 };
+      Snapshot table;
+      table.epoch = ++epochs;
+      return table;
+    }
+
+    // applies a band info object, as found in info/get responses and provisioned notifications; returns true if the table changed
+    inline bool band_info( Snapshot* table, const char* p, const char* end ){
+      std::string pid;
+      const char* provisioned = p;
+      const char* provisioned_end = end;
+      if( !string_member( p, end, "pid", &pid ) ){
+        if( !find_member( p, end, "provisioned", &provisioned, &provisioned_end ) ) return false;
+        if( !string_member( provisioned, provisioned_end, "pid", &pid ) ) return false;
+      }
+      bool modified = false;
+      std::size_t r = row( table, pid, &modified );
+      std::string literal;
+      double number;
+      if( string_member( p, end, "present", &literal ) ) update( table->present[ r ], presence( literal ), &modified );
+      if( string_member( p, end, "found", &literal ) ){
+        update( table->found[ r ], found( literal ), &modified );
+        update( table->authenticated[ r ], table->found[ r ] == Found::authenticated, &modified );
+      }
+      if( number_member( p, end, "RSSI_smoothed", &number ) ) update( table->RSSI_smoothed[ r ], number, &modified );
+      if( number_member( provisioned, provisioned_end, "authenticationWindowRemaining", &number ) ) update( table->authenticationWindowRemaining[ r ], number, &modified );
+      if( number_member( provisioned, provisioned_end, "commandsQueued", &number ) ) update( table->commandsQueued[ r ], number, &modified );
+      if( modified ) table->changed[ r ] = table->version;
+      return modified;
+    }
+
+    // applies a message from NAPI to the table, returns true if the table changed
+    inline bool observe( Snapshot* table, Path path, const char* json, const char* end ){
+      const char* event;
+      const char* event_end;
+      std::string pid;
+      std::string literal;
+      switch( path ){
+        case Path::EventOnPresenceChangeData:{
+          if( !find_member( json, end, "event", &event, &event_end ) || !string_member( event, event_end, "pid", &pid ) ) return false;
+          bool modified = false;
+          std::size_t r = row( table, pid, &modified );
+          bool authenticated;
+          double remaining;
+          if( string_member( event, event_end, "after", &literal ) ) update( table->present[ r ], presence( literal ), &modified );
+          if( bool_member( event, event_end, "authenticated", &authenticated ) ) update( table->authenticated[ r ], authenticated, &modified );
+          if( number_member( event, event_end, "remaining", &remaining ) ) update( table->authenticationWindowRemaining[ r ], remaining, &modified );
+          if( modified ) table->changed[ r ] = table->version;
+          return modified;
+        }
+        case Path::EventOnFoundChangeData:{
+          if( !find_member( json, end, "event", &event, &event_end ) || !string_member( event, event_end, "pid", &pid ) ) return false;
+          bool modified = false;
+          std::size_t r = row( table, pid, &modified );
+          if( string_member( event, event_end, "after", &literal ) ){
+            update( table->found[ r ], found( literal ), &modified );
+            update( table->authenticated[ r ], table->found[ r ] == Found::authenticated, &modified );
+          }
+          if( modified ) table->changed[ r ] = table->version;
+          return modified;
+        }
+        case Path::EventOnProvisionedData:{
+          const char* info;
+          const char* info_end;
+          if( !find_member( json, end, "event", &event, &event_end ) || !find_member( event, event_end, "info", &info, &info_end ) ) return false;
+          return band_info( table, info, info_end );
+        }
+        case Path::InfoGet:{
+          const char* response;
+          const char* response_end;
+          const char* bands;
+          const char* bands_end;
+          if( !response_member( json, end, &response, &response_end ) ) return false;
+          if( !find_member( response, response_end, "nymiband", &bands, &bands_end ) || *bands != '[' ) return false;
+          bool changed = false;
+          for( const char* p = skip_space( bands + 1, bands_end ); p < bands_end && *p == '{'; ){
+            const char* next = skip_value( p, bands_end );
+            if( !next ) break;
+            changed = band_info( table, p, next ) || changed;
+            p = skip_space( next, bands_end );
+            if( p < bands_end && *p == ',' ) p = skip_space( p + 1, bands_end );
+          }
+          return changed;
+        }
+        default:
+          return false;
+      }
+    }
+  }
+
+  /**
+   * \brief What a napi::Queue does when a message arrives and it is full.
+   *
+   * Only notifications are ever discarded; responses are always queued, even if the queue is over capacity.
+   */
+  enum class Overflow{
+      dropOldest, //!< Drop the oldest notification in the queue (or the arriving notification, if only responses are queued).
+      block, //!< Stop receiving from NAPI until the queue has room. Messages then accumulate inside NAPI, and every queue of the dispatcher waits.
+      coalesce, //!< Replace the newest queued notification with the same path and band (`pid`) by the arriving one, otherwise drop the oldest notification as napi::Overflow::dropOldest.
+  };
+
+  /**
+   * \brief A queue of JSON messages filled by napi::Dispatcher.
+   *
+   * The queue's get and try_get mirror napi::get and napi::try_get: once NAPI terminates, and the queue has been
+   * drained, get returns napi::GetOutcome::terminated once and napi::GetOutcome::notRunning afterwards.
+   *
+   * A queue with a capacity holds at most that many notifications; what happens when a notification arrives at a full
+   * queue is chosen by napi::Overflow, and counted in napi::Queue::dropped and napi::Queue::coalesced. Responses are never
+   * discarded. This keeps memory flat during a storm of notifications that the NEA cannot keep up with.
+   *
+   * Independently of its capacity a queue can keep only the latest presence-change and found-change notification for
+   * each band, see napi::Queue::keep_latest_per_band.
+   *
+   * On Linux and macOS the queue can also be waited on with select, poll, epoll or kqueue -- see napi::Queue::fd.
+   *
+   * The string passed to get or try_get is swapped with the message, and its previous buffer is cleared and kept for a
+   * later message. An NEA that reuses one string per consumer therefore receives without an allocation per message (see
+   * napi::Queue::recycled). Messages the queue discards -- dropped or replaced on overflow, or still queued when the queue
+   * is destroyed -- are cleared as well, so a response carrying key material does not linger in a freed buffer.
+   *
+   * A queue may be used from any number of threads.
+   */
+  class Queue{
+    public:
+      /**
+       * \param[in] capacity the maximum number of messages held, 0 for no limit
+       * \param[in] overflow what to do when a message arrives and the queue is full
+       * \param[in] spares the number of cleared buffers kept for later messages, see napi::Queue::recycled
+       */
+      explicit Queue( unsigned long long capacity = 0, Overflow overflow = Overflow::dropOldest, std::size_t spares = 16 )
+        : capacity_( capacity ), overflow_( overflow ), spares_( spares ){}
+
+      ~Queue(){
+        for( Message& message : messages_ ) clear( &message.json );
+#if !defined(_WIN32)
+        if( read_fd_ != -1 ) ::close( read_fd_ );
+        if( write_fd_ != -1 && write_fd_ != read_fd_ ) ::close( write_fd_ );
+#endif
+      }
+
+#if !defined(_WIN32)
+      /**
+       * \brief A file descriptor that is readable while the queue holds a message or has been closed, for use in an event loop.
+       *
+       * The descriptor is an eventfd on Linux and the read end of a pipe elsewhere. It is created by the first call and
+       * owned by the queue; the NEA must only wait on it, and then call try_get until it reports napi::TryGetOutcome::nothing.
+       * Once try_get has reported napi::TryGetOutcome::terminated the descriptor stays readable and should be removed
+       * from the event loop.
+       *
+       * \return the descriptor, or -1 if it could not be created
+       */
+      int fd(){
+        std::lock_guard< std::mutex > lock( mutex_ );
+        if( read_fd_ == -1 ){
+#if defined(__linux__)
+          read_fd_ = write_fd_ = ::eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+#else
+          int fds[ 2 ];
+          if( ::pipe( fds ) == 0 ){
+            for( int f : fds ){
+              ::fcntl( f, F_SETFL, ::fcntl( f, F_GETFL ) | O_NONBLOCK );
+              ::fcntl( f, F_SETFD, FD_CLOEXEC );
+            }
+            read_fd_ = fds[ 0 ];
+            write_fd_ = fds[ 1 ];
+          }
+#endif
+          if( !messages_.empty() || state_ != State::running ) signal();
+        }
+        return read_fd_;
+      }
+#endif
+
+      /**
+       * \brief Take the next JSON message from the queue, blocks if nothing is available yet.
+       */
+      GetOutcome get( std::string* json ){
+        std::unique_lock< std::mutex > lock( mutex_ );
+        ready_.wait( lock, [ this ]{ return !messages_.empty() || state_ != State::running; } );
+        if( !messages_.empty() ){
+          take( json );
+          return GetOutcome::okay;
+        }
+        return finished() == TryGetOutcome::terminated ? GetOutcome::terminated : GetOutcome::notRunning;
+      }
+
+      /**
+       * \brief Take the next JSON message from the queue if one is available, non-blocking.
+       */
+      TryGetOutcome try_get( std::string* json ){
+        std::lock_guard< std::mutex > lock( mutex_ );
+        if( !messages_.empty() ){
+          take( json );
+          return TryGetOutcome::okay;
+        }
+        return state_ == State::running ? TryGetOutcome::nothing : finished();
+      }
+
+      /**
+       * \brief Take the next JSON message from the queue, blocks for at most `timeout` if nothing is available yet.
+       *
+       * The outcome is napi::TryGetOutcome::nothing if the timeout expires, or napi::Queue::interrupt is called, before a
+       * message arrives; otherwise it is the same as napi::Queue::try_get.
+       */
+      TryGetOutcome get_for( std::string* json, milliseconds timeout ){
+        std::unique_lock< std::mutex > lock( mutex_ );
+        unsigned long long interrupts = interrupts_;
+        ready_.wait_for( lock, std::chrono::milliseconds( timeout ), [ this, interrupts ]{
+          return !messages_.empty() || state_ != State::running || interrupts_ != interrupts;
+        } );
+        if( !messages_.empty() ){
+          take( json );
+          return TryGetOutcome::okay;
+        }
+        return state_ == State::running ? TryGetOutcome::nothing : finished();
+      }
+
+      /**
+       * \brief Wake every thread currently waiting in napi::Queue::get_for, without a message.
+       *
+       * This allows a consumer thread to be stopped promptly without calling napi::terminate.
+       */
+      void interrupt(){
+        {
+          std::lock_guard< std::mutex > lock( mutex_ );
+          ++interrupts_;
+        }
+        ready_.notify_all();
+      }
+
+      /**
+       * \brief The number of messages waiting in the queue.
+       */
+      unsigned long long size() const{
+        std::lock_guard< std::mutex > lock( mutex_ );
+        return messages_.size();
+      }
+
+      /**
+       * \brief The largest number of messages the queue has held at once.
+       */
+      unsigned long long high_water() const{
+        std::lock_guard< std::mutex > lock( mutex_ );
+        return high_water_;
+      }
+
+      /**
+       * \brief How long messages waited in the queue, from their arrival to being taken.
+       */
+      Histogram latency() const{ return latency_.read(); }
+
+      /**
+       * \brief The number of notifications dropped because the queue was full.
+       */
+      unsigned long long dropped() const{
+        std::lock_guard< std::mutex > lock( mutex_ );
+        return dropped_;
+      }
+
+      /**
+       * \brief Keep at most one presence-change and one found-change notification per band (`pid`) in the queue.
+       *
+       * When enabled a presence-change or found-change notification for a band that already has one of the same kind
+       * waiting replaces it in place, and is counted in napi::Queue::coalesced. The queue then holds messages in proportion
+       * to the number of bands rather than to the number of events -- only the latest state of a band matters to an NEA
+       * that has fallen behind. The `before` state in a replacement is the state before the latest change, not the state
+       * before the first change that was replaced.
+       */
+      void keep_latest_per_band( bool enable ){ latest_per_band_ = enable; }
+
+      /**
+       * \brief The number of notifications that replaced a queued notification.
+       */
+      unsigned long long coalesced() const{
+        std::lock_guard< std::mutex > lock( mutex_ );
+        return coalesced_;
+      }
+
+      /**
+       * \brief The number of messages copied into a recycled buffer rather than a newly allocated one.
+       */
+      unsigned long long recycled() const{
+        std::lock_guard< std::mutex > lock( mutex_ );
+        return recycled_;
+      }
+
+    private:
+      friend class Dispatcher;
+
+      Queue( const Queue& ) = delete;
+      Queue& operator=( const Queue& ) = delete;
+
+      enum class State{ running, terminated, stopped };
+
+      struct Message{
+          std::string json;
+          bool notification;
+          Path path;
+          std::string pid;
+          std::chrono::steady_clock::time_point arrived;
+      };
+
+      bool full() const{ return capacity_ != 0 && messages_.size() >= capacity_; }
+
+      // copies the message into a recycled buffer when one is spare
+      void push( const char* json, const char* end, bool notification, Path path ){
+        std::string buffer;
+        {
+          std::lock_guard< std::mutex > lock( mutex_ );
+          if( !spare_.empty() ){
+            buffer.swap( spare_.back() );
+            spare_.pop_back();
+            ++recycled_;
+          }
+        }
+        buffer.assign( json, end );
+        push( std::move( buffer ), notification, path );
+      }
+
+      void push( std::string&& json, bool notification, Path path ){
+        std::string pid;
+        bool latest_per_band = latest_per_band_ && ( path == Path::EventOnPresenceChangeData || path == Path::EventOnFoundChangeData );
+        if( latest_per_band || ( notification && overflow_ == Overflow::coalesce ) ){
+          const char* event;
+          const char* event_end;
+          const char* end = json.data() + json.size();
+          if( detail::find_member( json.data(), end, "event", &event, &event_end ) ) detail::string_member( event, event_end, "pid", &pid );
+        }
+        {
+          // every message the queue does not keep is recycled, which clears it
+          std::unique_lock< std::mutex > lock( mutex_ );
+          if( state_ != State::running ){
+            recycle( &json );
+            return;
+          }
+          if( latest_per_band && !pid.empty() ){
+            for( Message& message : messages_ ){
+              if( message.path == path && message.pid == pid ){
+                message.json.swap( json );
+                ++coalesced_;
+                recycle( &json );
+                return;
+              }
+            }
+          }
+          if( overflow_ == Overflow::block ) space_.wait( lock, [ this ]{ return !full() || state_ != State::running; } );
+          if( state_ != State::running ){
+            recycle( &json );
+            return;
+          }
+          if( full() && notification ){
+            if( overflow_ == Overflow::coalesce ){
+              for( auto i = messages_.rbegin(); i != messages_.rend(); ++i ){
+                if( i->notification && i->path == path && i->pid == pid ){
+                  i->json.swap( json );
+                  ++coalesced_;
+                  recycle( &json );
+                  return;
+                }
+              }
+            }
+            ++dropped_;
+            auto oldest = messages_.begin();
+            while( oldest != messages_.end() && !oldest->notification ) ++oldest;
+            if( oldest == messages_.end() ){
+              recycle( &json );
+              return;
+            }
+            recycle( &oldest->json );
+            messages_.erase( oldest );
+          }
+          messages_.push_back( Message{ std::move( json ), notification, path, std::move( pid ), std::chrono::steady_clock::now() } );
+          if( messages_.size() > high_water_ ) high_water_ = messages_.size();
+          signal();
+        }
+        ready_.notify_one();
+      }
+
+      void close(){
+        {
+          std::lock_guard< std::mutex > lock( mutex_ );
+          state_ = State::terminated;
+          signal();
+        }
+        ready_.notify_all();
+        space_.notify_all();
+      }
+
+      void take( std::string* json ){
+        json->swap( messages_.front().json );
+        latency_.record( std::chrono::steady_clock::now() - messages_.front().arrived );
+        recycle( &messages_.front().json );
+        messages_.pop_front();
+        if( messages_.empty() && state_ == State::running ) unsignal();
+        if( overflow_ == Overflow::block ) space_.notify_one();
+      }
+
+      // overwrites the contents of a buffer before it is reused or freed
+      static void clear( std::string* buffer ){
+        if( buffer->empty() ) return;
+        volatile char* p = &( *buffer )[ 0 ];
+        for( std::size_t i = 0; i < buffer->size(); ++i ) p[ i ] = 0;
+        buffer->clear();
+      }
+
+      // clears a buffer the queue no longer needs and keeps it for a later message; called with mutex_ held
+      void recycle( std::string* buffer ){
+        clear( buffer );
+        // a buffer small enough to live inside the string itself is not worth keeping
+        if( spare_.size() < spares_ && buffer->capacity() > sizeof( std::string ) ) spare_.push_back( std::move( *buffer ) );
+      }
+
+      // the descriptor is kept readable exactly while there is something to take; called with mutex_ held
+      void signal(){
+#if !defined(_WIN32)
+        if( write_fd_ == -1 || signalled_ ) return;
+#if defined(__linux__)
+        const unsigned long long one = 1;
+#else
+        const char one = 1;
+#endif
+        signalled_ = ::write( write_fd_, &one, sizeof( one ) ) == sizeof( one );
+#endif
+      }
+
+      void unsignal(){
+#if !defined(_WIN32)
+        if( !signalled_ ) return;
+#if defined(__linux__)
+        unsigned long long count;
+#else
+        char count;
+#endif
+        signalled_ = ::read( read_fd_, &count, sizeof( count ) ) != sizeof( count );
+#endif
+      }
+
+      TryGetOutcome finished(){
+        if( state_ != State::terminated ) return TryGetOutcome::notRunning;
+        state_ = State::stopped;
+        return TryGetOutcome::terminated;
+      }
+
+      mutable std::mutex mutex_;
+      std::condition_variable ready_;
+      std::condition_variable space_;
+      std::deque< Message > messages_;
+      unsigned long long capacity_;
+      Overflow overflow_;
+      unsigned long long dropped_ = 0;
+      unsigned long long coalesced_ = 0;
+      unsigned long long high_water_ = 0;
+      unsigned long long recycled_ = 0;
+      std::size_t spares_;
+      std::vector< std::string > spare_;
+      detail::Recorder latency_;
+      unsigned long long interrupts_ = 0;
+      std::atomic< bool > latest_per_band_{ false };
+      State state_ = State::running;
+#if !defined(_WIN32)
+      int read_fd_ = -1;
+      int write_fd_ = -1;
+      bool signalled_ = false;
+#endif
+  };
+
+  /**
+   * \brief Receives everything from NAPI on its own thread and dispatches the responses by `exchange`.
+   *
+   * This is the third approach described on the <a href="index.html">Main Page</a>, written once. A request made
+   * through the dispatcher is given an `exchange` generated by the dispatcher (replacing any `exchange` already in the
+   * JSON), and its final response is delivered straight to the future or handler supplied with the request. Interim
+   * progress messages, those that are not `completed` and carry `tracking`, are discarded.
+   *
+   * Every message that does not answer a dispatcher request -- notifications, and responses to messages sent with
+   * napi::put directly -- is delivered by its `path` to the queues subscribed to that path (see napi::Dispatcher::subscribe),
+   * or to napi::Dispatcher::queue when no queue is subscribed to it.
+   *
+   * Only the top level `exchange` and `path` members of each message are examined to route it; messages are not parsed.
+   * The dispatcher also keeps a table of the state of every band from the notifications and `info/get` responses that pass
+   * through it, see napi::Dispatcher::snapshot, and measures the latency of each request, see napi::Dispatcher::stats.
+   * When enabled it also records when each request reaches each napi::Stage, see napi::Dispatcher::trace.
+   *
+   * \note
+   * -# The dispatcher receives with napi::get, so while a dispatcher exists nothing else should call napi::get or napi::try_get.
+   * -# Handlers are called on the dispatcher's thread and should return promptly.
+   * -# Requests may be made from any number of threads. Waiting requests are kept in shards by `exchange`, so threads
+   *    making interactive requests at once only share a lock when their exchanges land in the same shard -- unless the
+   *    requests have a timeout, which is registered under the dispatcher's own lock, or tracing is on (see
+   *    napi::Dispatcher::trace), which records every stage under one lock. Concurrent calls to napi::put rely on the
+   *    assumption described under Threads on the main page.
+   * -# The dispatcher stops when NAPI terminates; requests still waiting end with napi::RequestOutcome::terminated.
+   *    To restart NAPI, call napi::terminate, destroy the dispatcher, call napi::configure and create a new dispatcher.
+   * -# The destructor waits for the dispatcher's thread, which is blocked in napi::get until NAPI terminates -- call
+   *    napi::terminate before destroying a dispatcher once NAPI has been configured.
+   * -# A request that is cancelled or times out is forgotten; if its response arrives later it is delivered like any
+   *    other unsolicited message.
+   * -# NAPI sends requests to the bands in the order it receives them. Requests made with napi::Priority::background are
+   *    therefore held by the dispatcher and only a few are given to NAPI at a time (see napi::Dispatcher::background_window),
+   *    so an interactive request is never queued in NAPI behind more than that many background ones.
+   */
+  class Dispatcher{
+    public:
+      typedef std::function< void( const Response& response ) > Handler;
+
+      /**
+       * \brief Called with the final responses of napi::Dispatcher::request_all, in the order of the requests.
+       */
+      typedef std::function< void( std::vector< Response >& responses ) > GroupHandler;
+
+      /**
+       * \param[in] capacity the maximum number of messages held by napi::Dispatcher::queue, 0 for no limit
+       * \param[in] overflow what napi::Dispatcher::queue does when a message arrives and it is full
+       * \param[in] spares the number of cleared buffers napi::Dispatcher::queue keeps for later messages
+       */
+      explicit Dispatcher( unsigned long long capacity = 0, Overflow overflow = Overflow::dropOldest, std::size_t spares = 16 )
+        : queue_( std::make_shared< Queue >( capacity, overflow, spares ) ),
+          thread_( &Dispatcher::pump, this ){}
+
+      ~Dispatcher(){
+        stopping_ = true;
+        close();
+        thread_.join();
+        {
+          std::lock_guard< std::mutex > lock( mutex_ );
+          expiring_ = false;
+        }
+        deadlines_changed_.notify_one();
+        if( timer_.joinable() ) timer_.join();
+      }
+
+      /**
+       * \brief Send a JSON request to NAPI, its final response will be delivered to `response`.
+       *
+       * \param[in] path the path of the request
+       * \param[in] json the request
+       * \param[out] response set to a future for the final response (set only if the outcome is napi::PutOutcome::okay)
+       * \param[in] timeout how long to wait for the final response, 0 to wait indefinitely
+       */
+      PutOutcome request( Path path, const char* json, std::future< Response >* response, milliseconds timeout = 0 ){
+        std::shared_ptr< std::promise< Response > > promise = std::make_shared< std::promise< Response > >();
+        PutOutcome outcome = request( path, json, [ promise ]( const Response& r ){ promise->set_value( r ); }, timeout );
+        if( outcome == PutOutcome::okay ) *response = promise->get_future();
+        return outcome;
+      }
+
+      /**
+       * \brief Send a JSON request to NAPI, its final response will be passed to `handler`.
+       *
+       * \param[in] path the path of the request
+       * \param[in] json the request
+       * \param[in] handler called with the final response (called only if the outcome is napi::PutOutcome::okay)
+       * \param[in] timeout how long to wait for the final response, 0 to wait indefinitely
+       * \param[out] exchange set to the `exchange` of the request, for use with napi::Dispatcher::cancel
+       *
+       * The handler is called on the dispatcher's thread, or on the thread calling napi::Dispatcher::cancel. A request
+       * that times out ends with napi::RequestOutcome::timedOut on a timer thread shared by all the dispatcher's requests.
+       */
+      PutOutcome request( Path path, const char* json, Handler handler, milliseconds timeout = 0, std::string* exchange = nullptr ){
+        return request( path, json, std::move( handler ), Priority::interactive, timeout, exchange );
+      }
+
+      /**
+       * \brief Send a JSON request to NAPI with the given priority, its final response will be delivered to `response`.
+       *
+       * \param[in] path the path of the request
+       * \param[in] json the request
+       * \param[out] response set to a future for the final response (set only if the outcome is napi::PutOutcome::okay)
+       * \param[in] priority the class of the request
+       * \param[in] timeout how long to wait for the final response, including any time held by the dispatcher, 0 to wait indefinitely
+       */
+      PutOutcome request( Path path, const char* json, std::future< Response >* response, Priority priority, milliseconds timeout = 0 ){
+        std::shared_ptr< std::promise< Response > > promise = std::make_shared< std::promise< Response > >();
+        PutOutcome outcome = request( path, json, [ promise ]( const Response& r ){ promise->set_value( r ); }, priority, timeout );
+        if( outcome == PutOutcome::okay ) *response = promise->get_future();
+        return outcome;
+      }
+
+      /**
+       * \brief Send a JSON request to NAPI with the given priority, its final response will be passed to `handler`.
+       *
+       * \param[in] path the path of the request
+       * \param[in] json the request
+       * \param[in] handler called with the final response (called only if the outcome is napi::PutOutcome::okay)
+       * \param[in] priority the class of the request
+       * \param[in] timeout how long to wait for the final response, including any time held by the dispatcher, 0 to wait indefinitely
+       * \param[out] exchange set to the `exchange` of the request, for use with napi::Dispatcher::cancel
+       *
+       * An interactive request is put at once. A background request is held and put when fewer than
+       * napi::Dispatcher::background_window background requests are waiting for a response, taking the held requests
+       * for each `request.pid` in turn so a sweep over many bands shares the radio fairly. The outcome of a background
+       * request is napi::PutOutcome::okay once it is held; if napi::put later refuses it, it ends with
+       * napi::RequestOutcome::notSent.
+       */
+      PutOutcome request( Path path, const char* json, Handler handler, Priority priority, milliseconds timeout = 0, std::string* exchange = nullptr ){
+        unsigned long long number = ++exchanges_;
+        std::string id = "napi-dispatch-" + std::to_string( number );
+        std::string message;
+        if( !detail::with_exchange( json, id, &message ) ) return PutOutcome::unparseableJSON;
+        if( exchange ) *exchange = id;
+        if( priority == Priority::background ){
+          std::string pid;
+          const char* body;
+          const char* body_end;
+          if( detail::find_member( message.data(), message.data() + message.size(), "request", &body, &body_end ) ){
+            detail::string_member( body, body_end, "pid", &pid );
+          }
+          {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            if( terminated_ ) return PutOutcome::notRunning;
+            Shard& pending = shard( id );
+            std::lock_guard< std::mutex > pending_lock( pending.mutex );
+            pending.requests.emplace( id, Pending{ std::move( handler ), path, number, std::chrono::steady_clock::time_point(), std::chrono::steady_clock::time_point(), true } );
+            background_.emplace( id, Scheduled{ pid, false, false, false, std::chrono::steady_clock::time_point() } );
+            held_[ pid ].push_back( Held{ id, path, std::move( message ), std::chrono::steady_clock::now() } );
+          }
+          stamp( number, path, Stage::held, std::chrono::steady_clock::now() );
+          if( timeout > 0 ) expire( id, std::chrono::steady_clock::now() + std::chrono::milliseconds( timeout ) );
+          release();
+          return PutOutcome::okay;
+        }
+        Shard& pending = shard( id );
+        {
+          // registered before the put, the response can arrive before put returns
+          std::lock_guard< std::mutex > lock( pending.mutex );
+          if( terminated_ ) return PutOutcome::notRunning;
+          pending.requests.emplace( id, Pending{ std::move( handler ), path, number, std::chrono::steady_clock::now(), std::chrono::steady_clock::time_point(), false } );
+          interactive_.fetch_add( 1, std::memory_order_relaxed );
+        }
+        std::chrono::steady_clock::time_point put = std::chrono::steady_clock::now();
+        PutOutcome outcome = napi::put( path, message.c_str() );
+        if( outcome != PutOutcome::okay ){
+          std::lock_guard< std::mutex > lock( pending.mutex );
+          // a cancel may already have taken it
+          if( pending.requests.erase( id ) ) interactive_.fetch_sub( 1, std::memory_order_relaxed );
+          return outcome;
+        }
+        stamp( number, path, Stage::put, put );
+        if( timeout > 0 ) expire( id, std::chrono::steady_clock::now() + std::chrono::milliseconds( timeout ) );
+        return outcome;
+      }
+
+      /**
+       * \brief Send several JSON requests to NAPI together, their final responses will be delivered to `responses` at once.
+       *
+       * \param[in] requests the path and JSON of each request, for example a `symmetricKey/get` and a `sign/run` for the same pid
+       * \param[out] responses set to a future for the final responses, in the order of `requests` (set only if the outcome is napi::PutOutcome::okay)
+       * \param[in] timeout how long to wait for each final response, 0 to wait indefinitely
+       *
+       * The requests are put back to back, so NAPI has all of them queued for the band when it next connects to it. If
+       * napi::put does not accept one of them, those already sent are cancelled and its outcome is returned.
+       */
+      PutOutcome request_all( const std::vector< std::pair< Path, std::string > >& requests,
+                              std::future< std::vector< Response > >* responses, milliseconds timeout = 0 ){
+        return request_all( requests, responses, Priority::interactive, timeout );
+      }
+
+      /**
+       * \brief Send several JSON requests to NAPI together with the given priority, their final responses will be delivered to `responses` at once.
+       *
+       * \param[in] requests the path and JSON of each request
+       * \param[out] responses set to a future for the final responses, in the order of `requests` (set only if the outcome is napi::PutOutcome::okay)
+       * \param[in] priority the class of the requests
+       * \param[in] timeout how long to wait for each final response, including any time held by the dispatcher, 0 to wait indefinitely
+       */
+      PutOutcome request_all( const std::vector< std::pair< Path, std::string > >& requests,
+                              std::future< std::vector< Response > >* responses, Priority priority, milliseconds timeout = 0 ){
+        std::shared_ptr< std::promise< std::vector< Response > > > promise = std::make_shared< std::promise< std::vector< Response > > >();
+        PutOutcome outcome = request_all( requests, [ promise ]( std::vector< Response >& r ){ promise->set_value( std::move( r ) ); }, priority, timeout );
+        if( outcome == PutOutcome::okay ) *responses = promise->get_future();
+        return outcome;
+      }
+
+      /**
+       * \brief Send several JSON requests to NAPI together, their final responses will be passed to `handler` at once.
+       *
+       * \param[in] requests the path and JSON of each request
+       * \param[in] handler called with the final responses, in the order of `requests` (called only if the outcome is napi::PutOutcome::okay)
+       * \param[in] timeout how long to wait for each final response, 0 to wait indefinitely
+       */
+      PutOutcome request_all( const std::vector< std::pair< Path, std::string > >& requests, GroupHandler handler, milliseconds timeout = 0 ){
+        return request_all( requests, std::move( handler ), Priority::interactive, timeout );
+      }
+
+      /**
+       * \brief Send several JSON requests to NAPI together with the given priority, their final responses will be passed to `handler` at once.
+       *
+       * \param[in] requests the path and JSON of each request
+       * \param[in] handler called with the final responses, in the order of `requests` (called only if the outcome is napi::PutOutcome::okay)
+       * \param[in] priority the class of the requests
+       * \param[in] timeout how long to wait for each final response, including any time held by the dispatcher, 0 to wait indefinitely
+       *
+       * Interactive requests are put back to back, so NAPI has all of them queued for the band when it next connects to
+       * it. Background requests are held and put through napi::Dispatcher::background_window like any other, so they
+       * may reach NAPI one at a time. If napi::put does not accept one of the requests, those already sent are cancelled
+       * and its outcome is returned. With no requests the handler is called at once.
+       */
+      PutOutcome request_all( const std::vector< std::pair< Path, std::string > >& requests, GroupHandler handler,
+                              Priority priority, milliseconds timeout = 0 ){
+        struct Group{
+            std::mutex mutex;
+            std::vector< Response > responses;
+            std::size_t remaining;
+            GroupHandler handler;
+        };
+        if( requests.empty() ){
+          std::vector< Response > none;
+          handler( none );
+          return PutOutcome::okay;
+        }
+        std::shared_ptr< Group > group = std::make_shared< Group >();
+        group->responses.resize( requests.size() );
+        group->remaining = requests.size();
+        group->handler = std::move( handler );
+
+        std::vector< std::string > exchanges( requests.size() );
+        for( std::size_t i = 0; i < requests.size(); ++i ){
+          PutOutcome outcome = request( requests[ i ].first, requests[ i ].second.c_str(), [ group, i ]( const Response& response ){
+            {
+              std::lock_guard< std::mutex > lock( group->mutex );
+              group->responses[ i ] = response;
+              if( --group->remaining > 0 ) return;
+            }
+            group->handler( group->responses );
+          }, priority, timeout, &exchanges[ i ] );
+          if( outcome != PutOutcome::okay ){
+            for( std::size_t j = 0; j < i; ++j ) cancel( exchanges[ j ] );
+            return outcome;
+          }
+        }
+        return PutOutcome::okay;
+      }
+
+      /**
+       * \brief Set how many background requests may be waiting for a response from NAPI at once; the rest are held.
+       *
+       * The default is 1, which bounds the delay of an interactive request to one background operation. 0 holds every
+       * background request until the window is raised.
+       *
+       * NAPI carries out a request it has been given even if the dispatcher has ended it, so a background request that is
+       * cancelled or times out after it was put keeps its place in the window until NAPI sends its response -- but for no
+       * longer than napi::Dispatcher::abandon_timeout, and not past napi::Dispatcher::cancel_all or the termination of
+       * NAPI, so a band that never answers cannot hold up the other bands for good; see napi::Schedule::abandoned.
+       */
+      void background_window( unsigned long long window ){
+        {
+          std::lock_guard< std::mutex > lock( mutex_ );
+          window_ = window;
+        }
+        release();
+      }
+
+      /**
+       * \brief Set how long a background request that ended before NAPI answered it keeps its place in the window.
+       *
+       * The default is 10 seconds. 0 frees the place as soon as the request ends, as if NAPI had dropped it.
+       */
+      void abandon_timeout( milliseconds timeout ){
+        std::lock_guard< std::mutex > lock( mutex_ );
+        abandon_timeout_ = timeout;
+      }
+
+      /**
+       * \brief The number of requests of each class the dispatcher is waiting on, and the state of the round-robin.
+       */
+      Schedule schedule() const{
+        Schedule schedule;
+        std::lock_guard< std::mutex > lock( mutex_ );
+        for( auto& entry : held_ ){
+          schedule.pids[ entry.first ] = entry.second.size();
+          schedule.held += entry.second.size();
+        }
+        schedule.background = in_flight_;
+        schedule.abandoned = abandoned_;
+        schedule.interactive = interactive_.load( std::memory_order_relaxed );
+        schedule.turn = turn_;
+        schedule.released = released_;
+        return schedule;
+      }
+
+      /**
+       * \brief Start recording the stages of every request in a ring of the latest `capacity` events, 0 to stop.
+       *
+       * Recording an event takes a lock and copies a few words into the ring, so tracing can be left on. Starting again
+       * discards the events recorded so far.
+       */
+      void trace( unsigned long long capacity ){
+        std::lock_guard< std::mutex > lock( trace_mutex_ );
+        trace_.clear();
+        trace_.shrink_to_fit();
+        trace_.reserve( static_cast< std::size_t >( capacity ) );
+        trace_capacity_ = static_cast< std::size_t >( capacity );
+        trace_next_ = 0;
+        tracing_ = capacity > 0;
+      }
+
+      /**
+       * \brief The events in the trace ring, oldest first; see napi::chrome_trace to view them.
+       */
+      std::vector< TraceEvent > trace_events() const{
+        std::lock_guard< std::mutex > lock( trace_mutex_ );
+        std::vector< TraceEvent > events( trace_.begin() + trace_next_, trace_.end() );
+        events.insert( events.end(), trace_.begin(), trace_.begin() + trace_next_ );
+        return events;
+      }
+
+      /**
+       * \brief The dispatcher's counters and the latency of the requests made through it, by path.
+       *
+       * Latencies are recorded with a few relaxed atomic increments as each response arrives; reading them does not stop
+       * the dispatcher. The depth of each band's command queue is napi::Snapshot::commandsQueued, and the depth of a
+       * queue is napi::Queue::size and napi::Queue::high_water.
+       */
+      Stats stats() const{
+        Stats stats;
+        for( std::size_t i = 0; i < path_count; ++i ){
+          if( latencies_[ i ].total.read().count == 0 ) continue;
+          Latencies& latencies = stats.paths[ static_cast< Path >( i ) ];
+          latencies.accepted = latencies_[ i ].accepted.read();
+          latencies.band = latencies_[ i ].band.read();
+          latencies.total = latencies_[ i ].total.read();
+        }
+        stats.held = held_latency_.read();
+        stats.received = received_.load( std::memory_order_relaxed );
+        stats.interim = interim_.load( std::memory_order_relaxed );
+        stats.pending = size();
+        return stats;
+      }
+
+      /**
+       * \brief The latest state of every band the dispatcher has seen reported.
+       *
+       * Reading the snapshot is a memory read; it does not involve NAPI. The snapshot does not change once returned,
+       * call again for a newer one. The dispatcher updates its own table in place as messages arrive, and the table is
+       * copied only when it has changed since the last call, so a storm of notifications costs one copy per read rather
+       * than one per notification.
+       */
+      std::shared_ptr< const Snapshot > snapshot() const{
+        std::lock_guard< std::mutex > lock( snapshot_mutex_ );
+        if( stale_ ){
+          snapshot_ = std::make_shared< const Snapshot >( table_ );
+          stale_ = false;
+        }
+        return snapshot_;
+      }
+
+      /**
+       * \brief End a request made through this dispatcher with napi::RequestOutcome::cancelled.
+       *
+       * The request's handler is called on the calling thread.
+       *
+       * \return true if the request was still waiting for its response
+       */
+      bool cancel( const std::string& exchange ){
+        return finish( exchange, RequestOutcome::cancelled );
+      }
+
+      /**
+       * \brief End every request made through this dispatcher that is still waiting with napi::RequestOutcome::cancelled.
+       *
+       * napi::terminate waits for the operations NAPI has in flight, which can take many seconds. Calling cancel_all first
+       * releases the NEA's threads at once rather than when NAPI finishes terminating. The handlers are called on the
+       * calling thread. Background requests NAPI already has, including those that ended earlier, give up their place in
+       * napi::Dispatcher::background_window, so held requests are put at once.
+       *
+       * \return the number of requests cancelled
+       */
+      unsigned long long cancel_all(){
+        std::vector< Pending > pending;
+        {
+          std::lock_guard< std::mutex > lock( mutex_ );
+          drain( &pending );
+          held_.clear();
+          background_.clear();
+          in_flight_ = 0;
+          abandoned_ = 0;
+        }
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for( Pending& request : pending ){
+          stamp( request.number, request.path, Stage::ended, now );
+          request.handler( Response{ RequestOutcome::cancelled, std::string() } );
+        }
+        return pending.size();
+      }
+
+      /**
+       * \brief The queue of messages that do not answer a request made through this dispatcher and have no subscriber.
+       */
+      const std::shared_ptr< Queue >& queue() const{ return queue_; }
+
+      /**
+       * \brief Create a queue that receives every message with one of the given paths.
+       *
+       * \param[in] paths the paths to receive; notifications are identified by the napi::Path their `path` translates to (see napi::translateLiteralPath), such as napi::Path::EventOnPresenceChangeData
+       * \param[in] capacity the maximum number of messages the queue holds, 0 for no limit
+       * \param[in] overflow what the queue does when a message arrives and it is full
+       * \param[in] spares the number of cleared buffers the queue keeps for later messages
+       *
+       * Each subscribed queue is independent of the others, so a burst of one kind of notification cannot delay messages on
+       * another queue (unless a queue uses napi::Overflow::block). A message with a path subscribed by several queues is
+       * delivered to each of them.
+       */
+      std::shared_ptr< Queue > subscribe( const std::vector< Path >& paths, unsigned long long capacity = 0, Overflow overflow = Overflow::dropOldest,
+                                          std::size_t spares = 16 ){
+        std::shared_ptr< Queue > queue = std::make_shared< Queue >( capacity, overflow, spares );
+        std::lock_guard< std::mutex > lock( mutex_ );
+        if( terminated_ ) queue->close();
+        for( Path path : paths ) subscribers_[ path ].push_back( queue );
+        return queue;
+      }
+
+      /**
+       * \brief Stop delivering messages to a queue created by napi::Dispatcher::subscribe.
+       *
+       * The queue is closed: once it has been drained its consumers are told napi::GetOutcome::terminated, as they would be
+       * if NAPI had terminated.
+       */
+      void unsubscribe( const std::shared_ptr< Queue >& queue ){
+        queue->close();
+        std::lock_guard< std::mutex > lock( mutex_ );
+        for( auto& entry : subscribers_ ){
+          std::vector< std::shared_ptr< Queue > >& queues = entry.second;
+          for( auto i = queues.begin(); i != queues.end(); ){
+            if( *i == queue ) i = queues.erase( i );
+            else ++i;
+          }
+        }
+      }
+
+    private:
+      Dispatcher( const Dispatcher& ) = delete;
+      Dispatcher& operator=( const Dispatcher& ) = delete;
+
+      struct Pending{
+          Handler handler;
+          Path path;
+          unsigned long long number;
+          std::chrono::steady_clock::time_point put;
+          std::chrono::steady_clock::time_point interim;
+          bool background;
+      };
+
+      struct Held{
+          std::string exchange;
+          Path path;
+          std::string message;
+          std::chrono::steady_clock::time_point held;
+      };
+
+      struct Scheduled{
+          std::string pid;
+          bool sent;
+          bool abandoned;
+          bool answered;
+          std::chrono::steady_clock::time_point until; // when an abandoned request gives up its place
+      };
+
+      struct Timing{
+          detail::Recorder accepted;
+          detail::Recorder band;
+          detail::Recorder total;
+      };
+
+      // requests are spread over shards by exchange so threads making requests at once rarely share a lock
+      struct Shard{
+          mutable std::mutex mutex;
+          std::unordered_map< std::string, Pending > requests;
+      };
+
+      // Path::KeyDelete is the last path
+      static const std::size_t path_count = static_cast< std::size_t >( Path::KeyDelete ) + 1;
+      static const std::size_t shards = 16;
+
+      void pump(){
+        Receiver receiver;
+        for( ;; ){
+          const char* json;
+          unsigned long long len;
+          GetOutcome outcome = receiver.get( &json, &len );
+          if( outcome == GetOutcome::okay ){
+            received_.fetch_add( 1, std::memory_order_relaxed );
+            dispatch( json, json + len );
+            receiver.release();
+          }
+          else if( outcome == GetOutcome::terminated ){
+            terminate();
+            return;
+          }
+          else if( stopping_ ){
+            return;
+          }
+          else{
+            // NAPI is not running yet, see the discussion of napi::configure on the main page
+            std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+          }
+        }
+      }
+
+      void dispatch( const char* json, const char* end ){
+        std::string literal;
+        Path path = Path::NotificationGet;
+        bool known = detail::string_member( json, end, "path", &literal ) && translateLiteralPath( literal.c_str(), &path );
+        if( known ) observe( path, json, end );
+
+        std::string exchange;
+        if( detail::string_member( json, end, "exchange", &exchange ) ){
+          Pending request;
+          {
+            Shard& pending = shard( exchange );
+            std::lock_guard< std::mutex > lock( pending.mutex );
+            auto found = pending.requests.find( exchange );
+            if( found != pending.requests.end() ){
+              if( detail::is_interim( json, end ) ){
+                interim_.fetch_add( 1, std::memory_order_relaxed );
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                if( found->second.interim == std::chrono::steady_clock::time_point() ) found->second.interim = now;
+                stamp( found->second.number, found->second.path, Stage::progress, now );
+                return;
+              }
+              request = std::move( found->second );
+              if( !request.background ) interactive_.fetch_sub( 1, std::memory_order_relaxed );
+              pending.requests.erase( found );
+            }
+          }
+          if( request.handler ){
+            settle( exchange, true );
+            stamp( request.number, request.path, Stage::response, std::chrono::steady_clock::now() );
+            measure( request );
+            request.handler( Response{ RequestOutcome::okay, std::string( json, end ) } );
+            stamp( request.number, request.path, Stage::delivered, std::chrono::steady_clock::now() );
+            release();
+            return;
+          }
+          // the final response to a request of this dispatcher that has already ended
+          if( exchange.compare( 0, 14, "napi-dispatch-" ) == 0 && !detail::is_interim( json, end ) && reclaim( exchange, false ) ) release();
+        }
+        bool notification = known && detail::is_notification( path );
+        if( known ){
+          std::vector< std::shared_ptr< Queue > > queues;
+          {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            auto found = subscribers_.find( path );
+            if( found != subscribers_.end() ) queues = found->second;
+          }
+          if( !queues.empty() ){
+            for( auto& queue : queues ) queue->push( json, end, notification, path );
+            return;
+          }
+        }
+        queue_->push( json, end, notification, path );
+      }
+
+      // applied to the dispatcher's own table; napi::Dispatcher::snapshot copies it when it is next read
+      void observe( Path path, const char* json, const char* end ){
+        if( path != Path::EventOnPresenceChangeData && path != Path::EventOnFoundChangeData &&
+            path != Path::EventOnProvisionedData && path != Path::InfoGet ) return;
+        std::lock_guard< std::mutex > lock( snapshot_mutex_ );
+        ++table_.version;
+        if( detail::observe( &table_, path, json, end ) ) stale_ = true;
+        else --table_.version;
+      }
+
+      void stamp( unsigned long long exchange, Path path, Stage stage, std::chrono::steady_clock::time_point at ){
+        if( !tracing_.load( std::memory_order_relaxed ) ) return;
+        std::lock_guard< std::mutex > lock( trace_mutex_ );
+        if( trace_capacity_ == 0 ) return;
+        TraceEvent event{ exchange, path, stage, at };
+        if( trace_.size() < trace_capacity_ ) trace_.push_back( event );
+        else{
+          trace_[ trace_next_ ] = event;
+          trace_next_ = ( trace_next_ + 1 ) % trace_capacity_;
+        }
+      }
+
+      void measure( const Pending& request ){
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        Timing& timing = latencies_[ static_cast< std::size_t >( request.path ) ];
+        timing.total.record( now - request.put );
+        if( request.interim == std::chrono::steady_clock::time_point() ) return;
+        timing.accepted.record( request.interim - request.put );
+        timing.band.record( now - request.interim );
+      }
+
+      bool finish( const std::string& exchange, RequestOutcome outcome ){
+        Pending request;
+        if( !take( exchange, &request ) ) return false;
+        settle( exchange, false );
+        stamp( request.number, request.path, Stage::ended, std::chrono::steady_clock::now() );
+        request.handler( Response{ outcome, std::string() } );
+        release();
+        return true;
+      }
+
+      Shard& shard( const std::string& exchange ){ return pending_[ std::hash< std::string >()( exchange ) % shards ]; }
+
+      // removes a request from the pending requests
+      bool take( const std::string& exchange, Pending* request ){
+        Shard& pending = shard( exchange );
+        std::lock_guard< std::mutex > lock( pending.mutex );
+        auto found = pending.requests.find( exchange );
+        if( found == pending.requests.end() ) return false;
+        *request = std::move( found->second );
+        if( !request->background ) interactive_.fetch_sub( 1, std::memory_order_relaxed );
+        pending.requests.erase( found );
+        return true;
+      }
+
+      // moves every pending request into `requests`; called with mutex_ held, so no background request is half registered
+      void drain( std::vector< Pending >* requests ){
+        for( Shard& pending : pending_ ){
+          std::lock_guard< std::mutex > lock( pending.mutex );
+          for( auto& entry : pending.requests ){
+            if( !entry.second.background ) interactive_.fetch_sub( 1, std::memory_order_relaxed );
+            requests->push_back( std::move( entry.second ) );
+          }
+          pending.requests.clear();
+        }
+      }
+
+      unsigned long long size() const{
+        unsigned long long size = 0;
+        for( const Shard& pending : pending_ ){
+          std::lock_guard< std::mutex > lock( pending.mutex );
+          size += pending.requests.size();
+        }
+        return size;
+      }
+
+      // called once a request has been taken from the pending requests, frees its place in the window or the held queue; a
+      // request NAPI has but has not answered keeps its place, since NAPI still sends it to the band, until reclaim.
+      // `answered` is true when NAPI no longer has the request: it has answered it, or never accepted it
+      void settle( const std::string& exchange, bool answered ){
+        std::chrono::steady_clock::time_point until;
+        {
+          std::lock_guard< std::mutex > lock( mutex_ );
+          if( !settled( exchange, answered || abandon_timeout_ <= 0 ) ) return;
+          until = std::chrono::steady_clock::now() + std::chrono::milliseconds( abandon_timeout_ );
+          background_[ exchange ].until = until;
+        }
+        expire( exchange, until );
+      }
+
+      // settle with mutex_ held, returns true if the request was abandoned
+      bool settled( const std::string& exchange, bool answered ){
+        auto found = background_.find( exchange );
+        if( found == background_.end() ) return false;
+        if( found->second.sent ){
+          if( !answered && !found->second.answered ){
+            if( found->second.abandoned ) return false;
+            ++abandoned_;
+            found->second.abandoned = true;
+            return true;
+          }
+          if( found->second.abandoned ) --abandoned_;
+          --in_flight_;
+        }
+        else{
+          // release may already have dropped it from the held queue
+          auto held = held_.find( found->second.pid );
+          if( held != held_.end() ){
+            std::deque< Held >& requests = held->second;
+            for( auto i = requests.begin(); i != requests.end(); ++i ){
+              if( i->exchange == exchange ){
+                requests.erase( i );
+                break;
+              }
+            }
+            if( requests.empty() ) held_.erase( held );
+          }
+        }
+        background_.erase( found );
+        return false;
+      }
+
+      // frees the place in the window of a request that ended before NAPI answered it, once NAPI does or, if `expired`, once
+      // napi::Dispatcher::abandon_timeout has passed; if the request is still being ended, settle frees it instead
+      bool reclaim( const std::string& exchange, bool expired ){
+        std::lock_guard< std::mutex > lock( mutex_ );
+        auto found = background_.find( exchange );
+        if( found == background_.end() || !found->second.sent ) return false;
+        if( expired ){
+          if( !found->second.abandoned || found->second.until > std::chrono::steady_clock::now() ) return false;
+        }
+        else if( !found->second.abandoned ){
+          found->second.answered = true;
+          return false;
+        }
+        background_.erase( found );
+        --abandoned_;
+        --in_flight_;
+        return true;
+      }
+
+      // puts held background requests while the window has room, taking the pids in turn
+      void release(){
+        for( ;; ){
+          Held next;
+          unsigned long long number;
+          std::chrono::steady_clock::time_point put;
+          {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            if( terminated_ || in_flight_ >= window_ || held_.empty() ) return;
+            auto turn = held_.upper_bound( turn_ );
+            if( turn == held_.end() ) turn = held_.begin();
+            turn_ = turn->first;
+            next = std::move( turn->second.front() );
+            turn->second.pop_front();
+            if( turn->second.empty() ) held_.erase( turn );
+            Shard& pending = shard( next.exchange );
+            std::lock_guard< std::mutex > pending_lock( pending.mutex );
+            auto found = pending.requests.find( next.exchange );
+            // a request being cancelled is taken before it is settled
+            if( found == pending.requests.end() ) continue;
+            background_[ next.exchange ].sent = true;
+            found->second.put = std::chrono::steady_clock::now();
+            held_latency_.record( found->second.put - next.held );
+            number = found->second.number;
+            put = found->second.put;
+            ++in_flight_;
+            ++released_;
+          }
+          if( napi::put( next.path, next.message.c_str() ) == PutOutcome::okay ){
+            stamp( number, next.path, Stage::put, put );
+            continue;
+          }
+          // NAPI does not have the request, even if a cancel took it first and left it abandoned
+          Pending request;
+          bool taken = take( next.exchange, &request );
+          settle( next.exchange, true );
+          if( !taken ) continue;
+          stamp( number, next.path, Stage::ended, std::chrono::steady_clock::now() );
+          request.handler( Response{ RequestOutcome::notSent, std::string() } );
+        }
+      }
+
+      void expire( const std::string& exchange, std::chrono::steady_clock::time_point deadline ){
+        {
+          std::lock_guard< std::mutex > lock( mutex_ );
+          deadlines_.emplace( deadline, exchange );
+          if( !timer_.joinable() ) timer_ = std::thread( &Dispatcher::time, this );
+        }
+        deadlines_changed_.notify_one();
+      }
+
+      // a request that has already been answered leaves its deadline behind, finish ignores it when it comes due; the deadline
+      // of an abandoned request frees its place in the window
+      void time(){
+        std::unique_lock< std::mutex > lock( mutex_ );
+        while( expiring_ ){
+          if( deadlines_.empty() ){
+            deadlines_changed_.wait( lock );
+            continue;
+          }
+          auto first = deadlines_.begin();
+          if( first->first > std::chrono::steady_clock::now() ){
+            deadlines_changed_.wait_until( lock, first->first );
+            continue;
+          }
+          std::string exchange = std::move( first->second );
+          deadlines_.erase( first );
+          lock.unlock();
+          if( !finish( exchange, RequestOutcome::timedOut ) && reclaim( exchange, true ) ) release();
+          lock.lock();
+        }
+      }
+
+      void terminate(){
+        std::vector< Pending > pending;
+        {
+          std::lock_guard< std::mutex > lock( mutex_ );
+          terminated_ = true;
+          drain( &pending );
+          held_.clear();
+          background_.clear();
+          in_flight_ = 0;
+          abandoned_ = 0;
+        }
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for( Pending& request : pending ){
+          stamp( request.number, request.path, Stage::ended, now );
+          request.handler( Response{ RequestOutcome::terminated, std::string() } );
+        }
+        close();
+      }
+
+      // also releases the dispatcher's thread if it is waiting for room in a queue
+      void close(){
+        queue_->close();
+        std::lock_guard< std::mutex > lock( mutex_ );
+        for( auto& entry : subscribers_ ){
+          for( auto& queue : entry.second ) queue->close();
+        }
+      }
+
+      std::shared_ptr< Queue > queue_;
+      mutable std::mutex mutex_;
+      Shard pending_[ shards ];
+      std::map< std::string, std::deque< Held > > held_;
+      std::unordered_map< std::string, Scheduled > background_;
+      std::string turn_;
+      unsigned long long window_ = 1;
+      milliseconds abandon_timeout_ = 10000;
+      unsigned long long in_flight_ = 0;
+      unsigned long long abandoned_ = 0;
+      unsigned long long released_ = 0;
+      Timing latencies_[ path_count ];
+      detail::Recorder held_latency_;
+      std::atomic< unsigned long long > received_{ 0 };
+      std::atomic< unsigned long long > interim_{ 0 };
+      std::atomic< unsigned long long > interactive_{ 0 };
+      mutable std::mutex trace_mutex_;
+      std::vector< TraceEvent > trace_;
+      std::size_t trace_capacity_ = 0;
+      std::size_t trace_next_ = 0;
+      std::atomic< bool > tracing_{ false };
+      std::map< Path, std::vector< std::shared_ptr< Queue > > > subscribers_;
+      std::multimap< std::chrono::steady_clock::time_point, std::string > deadlines_;
+      std::condition_variable deadlines_changed_;
+      bool expiring_ = true;
+      mutable std::mutex snapshot_mutex_;
+      Snapshot table_ = detail::fresh_table();
+      mutable std::shared_ptr< const Snapshot > snapshot_ = std::make_shared< const Snapshot >( table_ );
+      mutable bool stale_ = false;
+      std::thread timer_;
+      std::atomic< unsigned long long > exchanges_{ 0 };
+      std::atomic< bool > stopping_{ false };
+      std::atomic< bool > terminated_{ false };
+      std::thread thread_;
+  };
+
+  /**
+   * \brief The difference between two successive sets of provisions, see napi::ProvisionLog.
+   *
+   */
+  struct ProvisionDelta{
+      unsigned long long version = 0; //!< The version of the provisions after this delta.
+      std::map< std::string, std::string > added; //!< The provision JSON of each newly provisioned pid.
+      std::map< std::string, std::string > updated; //!< The new provision JSON of each pid whose provision changed.
+      std::vector< std::string > removed; //!< The pids that are no longer provisioned.
+      std::map< std::string, std::string > others; //!< The new JSON of each member other than `provisions` that was added or changed.
+      std::vector< std::string > others_removed; //!< The members other than `provisions` that are no longer present.
+
+      /**
+       * \brief The delta as one line of JSON, suitable for appending to a log replayed by napi::ProvisionLog::load.
+       */
+      std::string json() const{
+        std::string out = "{\"version\":" + std::to_string( version ) + ",\"added\":";
+        object( added, &out );
+        out += ",\"updated\":";
+        object( updated, &out );
+        out += ",\"removed\":";
+        array( removed, &out );
+        out += ",\"others\":";
+        object( others, &out );
+        out += ",\"others_removed\":";
+        array( others_removed, &out );
+        return out + '}';
+      }
+
+    private:
+      static void array( const std::vector< std::string >& names, std::string* out ){
+        *out += '[';
+        for( std::size_t i = 0; i < names.size(); ++i ) *out += ( i ? ",\"" : "\"" ) + names[ i ] + '"';
+        *out += ']';
+      }
+
+      static void object( const std::map< std::string, std::string >& provisions, std::string* out ){
+        *out += '{';
+        for( auto i = provisions.begin(); i != provisions.end(); ++i ){
+          if( i != provisions.begin() ) *out += ',';
+          *out += '"' + i->first + "\":" + i->second;
+        }
+        *out += '}';
+      }
+  };
+
+  /**
+   * \brief Tracks the provisions NAPI reports, so the NEA can persist changes instead of the whole provision map.
+   *
+   * Every `provisions/changed` notification carries the complete map of provisions. napi::ProvisionLog::apply compares it
+   * with the previous one and produces a napi::ProvisionDelta of the pids added, updated and removed, and of the other
+   * members of the notification's `provisions` value that changed, with a version that increases by one for every change. An NEA can then store a base snapshot of the provisions plus a log of deltas, and
+   * rewrite the base only occasionally, for example when compacting the log at startup.
+   *
+   * On startup napi::ProvisionLog::load replays the base and the log, and napi::ProvisionLog::provisions gives the value
+   * to pass to napi::configure. Save napi::ProvisionLog::version with the base so the log can be checked for gaps.
+   *
+   * \note
+   * A ProvisionLog is not thread safe.
+   */
+  class ProvisionLog{
+    public:
+      /**
+       * \brief Replace the tracked provisions with a saved base snapshot followed by a log of deltas.
+       *
+       * \param[in] provisions the saved provisions, in the form passed to napi::configure
+       * \param[in] deltas the lines produced by napi::ProvisionDelta::json since the base was saved, in order
+       * \param[in] base_version the value of napi::ProvisionLog::version when the base was saved
+       * \return false if the base or a delta could not be read, or a delta's version does not follow the previous one (a
+       *         delta is missing from the log); deltas up to that point have been applied
+       */
+      bool load( const char* provisions, const char* deltas = "", unsigned long long base_version = 0 ){
+        provisions_.clear();
+        others_.clear();
+        version_ = base_version;
+        const char* end = provisions + std::strlen( provisions );
+        if( !read( provisions, end, &provisions_, &others_ ) ) return false;
+
+        end = deltas + std::strlen( deltas );
+        for( const char* p = detail::skip_space( deltas, end ); p < end; p = detail::skip_space( p, end ) ){
+          const char* next = detail::skip_value( p, end );
+          if( !next || !replay( p, next ) ) return false;
+          p = next;
+        }
+        return true;
+      }
+
+      /**
+       * \brief Update the tracked provisions from a `provisions/changed` notification.
+       *
+       * \param[in] json the notification
+       * \param[out] delta set to the changes (set only if the return value is true)
+       * \return true if the provisions changed
+       */
+      bool apply( const char* json, ProvisionDelta* delta ){
+        const char* end = json + std::strlen( json );
+        const char* response;
+        const char* response_end;
+        const char* provisions;
+        const char* provisions_end;
+        if( !detail::response_member( json, end, &response, &response_end ) ||
+            !detail::find_member( response, response_end, "provisions", &provisions, &provisions_end ) ) return false;
+
+        std::map< std::string, std::string > next;
+        std::map< std::string, std::string > next_others;
+        if( !read( provisions, provisions_end, &next, &next_others ) ) return false;
+        ProvisionDelta changes;
+        for( auto& entry : next ){
+          auto found = provisions_.find( entry.first );
+          if( found == provisions_.end() ) changes.added.insert( entry );
+          else if( found->second != entry.second ) changes.updated.insert( entry );
+        }
+        for( auto& entry : provisions_ ){
+          if( next.find( entry.first ) == next.end() ) changes.removed.push_back( entry.first );
+        }
+        for( auto& entry : next_others ){
+          auto found = others_.find( entry.first );
+          if( found == others_.end() || found->second != entry.second ) changes.others.insert( entry );
+        }
+        for( auto& entry : others_ ){
+          if( next_others.find( entry.first ) == next_others.end() ) changes.others_removed.push_back( entry.first );
+        }
+        provisions_.swap( next );
+        others_.swap( next_others );
+        if( changes.added.empty() && changes.updated.empty() && changes.removed.empty() &&
+            changes.others.empty() && changes.others_removed.empty() ) return false;
+        changes.version = ++version_;
+        *delta = std::move( changes );
+        return true;
+      }
+
+      /**
+       * \brief The tracked provisions, in the form passed to napi::configure.
+       */
+      std::string provisions() const{
+        std::string out = "{";
+        for( auto& other : others_ ) out += '"' + other.first + "\":" + other.second + ',';
+        out += "\"provisions\":{";
+        for( auto i = provisions_.begin(); i != provisions_.end(); ++i ){
+          if( i != provisions_.begin() ) out += ',';
+          out += '"' + i->first + "\":" + i->second;
+        }
+        return out + "}}";
+      }
+
+      /**
+       * \brief The version of the tracked provisions, the version of the last delta applied or loaded.
+       */
+      unsigned long long version() const{ return version_; }
+
+      /**
+       * \brief The number of provisioned pids.
+       */
+      unsigned long long size() const{ return provisions_.size(); }
+
+    private:
+      // reads a provisions object: its provisions member is the map of pids, other members are kept as they are
+      bool read( const char* p, const char* end, std::map< std::string, std::string >* provisions,
+                 std::map< std::string, std::string >* others ){
+        p = detail::skip_space( p, end );
+        if( p >= end || *p != '{' ) return false;
+        std::string name;
+        const char* value;
+        const char* value_end;
+        while( detail::next_member( &p, end, &name, &value, &value_end ) ){
+          if( name != "provisions" ){
+            ( *others )[ name ].assign( value, value_end );
+            continue;
+          }
+          std::string pid;
+          const char* provision;
+          const char* provision_end;
+          for( const char* q = value; detail::next_member( &q, value_end, &pid, &provision, &provision_end ); ){
+            ( *provisions )[ pid ].assign( provision, provision_end );
+          }
+        }
+        return true;
+      }
+
+      // applies the members of an object to map
+      static void assign( const char* value, const char* value_end, std::map< std::string, std::string >* map ){
+        std::string name;
+        const char* member;
+        const char* member_end;
+        for( const char* q = value; detail::next_member( &q, value_end, &name, &member, &member_end ); ){
+          ( *map )[ name ].assign( member, member_end );
+        }
+      }
+
+      // erases the names in an array of strings from map
+      static bool erase( const char* value, const char* value_end, std::map< std::string, std::string >* map ){
+        if( *value != '[' ) return false;
+        for( const char* q = detail::skip_space( value + 1, value_end ); q < value_end && *q == '"'; ){
+          const char* next = detail::skip_string( q, value_end );
+          if( !next ) return false;
+          map->erase( std::string( q + 1, next - 1 ) );
+          q = detail::skip_space( next, value_end );
+          if( q < value_end && *q == ',' ) q = detail::skip_space( q + 1, value_end );
+        }
+        return true;
+      }
+
+      bool replay( const char* p, const char* end ){
+        double version;
+        const char* value;
+        const char* value_end;
+        if( !detail::number_member( p, end, "version", &version ) ) return false;
+        if( static_cast< unsigned long long >( version ) != version_ + 1 ) return false;
+        for( const char* member : { "added", "updated" } ){
+          if( detail::find_member( p, end, member, &value, &value_end ) ) assign( value, value_end, &provisions_ );
+        }
+        if( detail::find_member( p, end, "removed", &value, &value_end ) && !erase( value, value_end, &provisions_ ) ) return false;
+        if( detail::find_member( p, end, "others", &value, &value_end ) ) assign( value, value_end, &others_ );
+        if( detail::find_member( p, end, "others_removed", &value, &value_end ) && !erase( value, value_end, &others_ ) ) return false;
+        version_ = static_cast< unsigned long long >( version );
+        return true;
+      }
+
+      std::map< std::string, std::string > provisions_;
+      std::map< std::string, std::string > others_;
+      unsigned long long version_ = 0;
+  };
+
+  /**
+   * \brief The result of napi::sign_batch.
+   */
+  struct BatchSignature{
+      Response response; //!< The `sign/run` response, its `signature` and `verificationkey` are for `root`.
+      merkle::Digest root; //!< The root of the Merkle tree over the submitted hashes, the hash the band signed.
+      std::vector< merkle::Proof > proofs; //!< The inclusion proof of each submitted hash, in the order submitted.
+  };
+
+  /**
+   * \brief Sign many SHA256 hashes with one `sign/run`, by having the band sign the root of a Merkle tree over them.
+   *
+   * \param[in] dispatcher the dispatcher to send the `sign/run` through
+   * \param[in] pid the band to sign with, its key must have been set up with `sign/setup`
+   * \param[in] hashes the SHA256 hashes to sign, at least one
+   * \param[out] signature set to a future for the signature and the proofs (set only if the outcome is napi::PutOutcome::okay)
+   * \param[in] timeout how long to wait for the band, 0 to wait indefinitely
+   *
+   * Give each item its hash's proof along with the signature and root; napi::merkle::verify (which does not need NAPI)
+   * checks an item against the root, and the signature over the root is checked with the band's `verificationkey`.
+   *
+   * \return napi::PutOutcome::error if `hashes` is empty, otherwise the outcome of putting the `sign/run`
+   */
+  inline PutOutcome sign_batch( Dispatcher& dispatcher, const std::string& pid, const std::vector< merkle::Digest >& hashes,
+                                std::future< BatchSignature >* signature, milliseconds timeout = 0 ){
+    if( hashes.empty() ) return PutOutcome::error;
+    merkle::Tree tree( hashes );
+    std::shared_ptr< BatchSignature > batch = std::make_shared< BatchSignature >();
+    batch->root = tree.root();
+    batch->proofs.reserve( hashes.size() );
+    for( std::size_t i = 0; i < hashes.size(); ++i ) batch->proofs.push_back( tree.proof( i ) );
+
+    std::shared_ptr< std::promise< BatchSignature > > promise = std::make_shared< std::promise< BatchSignature > >();
+    std::future< BatchSignature > future = promise->get_future();
+    std::string json = "{\"path\":\"sign/run\",\"request\":{\"pid\":\"" + pid + "\",\"hash\":\"" + merkle::hex( batch->root ) + "\"}}";
+    PutOutcome outcome = dispatcher.request( Path::SignRun, json.c_str(), [ batch, promise ]( const Response& response ){
+      batch->response = response;
+      promise->set_value( std::move( *batch ) );
+    }, timeout );
+    if( outcome == PutOutcome::okay ) *signature = std::move( future );
+    return outcome;
+  }
+
+  /**
+   * \brief Bytes of band entropy, see napi::random_bytes and napi::EntropyPool.
+   */
+  struct Entropy{
+      std::vector< unsigned char > bytes; //!< The bytes requested, empty if they could not all be obtained.
+      Response response; //!< If `bytes` is empty, the first `random/run` that did not return a `pseudoRandomNumber`, or the last one if together they returned fewer bytes than requested.
+  };
+
+  ///@private
+  namespace detail{
+    // appends the bytes of the pseudoRandomNumber in a random/run response
+    inline bool random_number( const std::string& json, std::vector< unsigned char >* bytes ){
+      const char* value;
+      const char* value_end;
+      std::string number;
+      if( !response_member( json.data(), json.data() + json.size(), &value, &value_end ) ||
+          !string_member( value, value_end, "pseudoRandomNumber", &number ) || number.empty() || number.size() % 2 ) return false;
+      std::size_t size = bytes->size();
+      for( std::size_t i = 0; i < number.size(); i += 2 ){
+        char digits[ 3 ] = { number[ i ], number[ i + 1 ], 0 };
+        char* digits_end;
+        unsigned long byte = std::strtoul( digits, &digits_end, 16 );
+        if( digits_end != digits + 2 ){
+          bytes->resize( size );
+          return false;
+        }
+        bytes->push_back( static_cast< unsigned char >( byte ) );
+      }
+      return true;
+    }
+
+    inline std::string random_request( const std::string& pid ){
+      return "{\"path\":\"random/run\",\"request\":{\"pid\":\"" + pid + "\"}}";
+    }
+  }
+
+  /**
+   * \brief Obtain `count` bytes of entropy from a band, using as many `random/run` requests as needed.
+   *
+   * \param[in] dispatcher the dispatcher to send the requests through
+   * \param[in] pid the band to ask
+   * \param[in] count the number of bytes wanted
+   * \param[out] entropy set to a future for the bytes (set only if the outcome is napi::PutOutcome::okay)
+   * \param[in] timeout how long to wait for each `random/run`, 0 to wait indefinitely
+   * \param[in] priority the class of the requests, see napi::Dispatcher::request
+   *
+   * Each `random/run` returns 16 bytes; the requests are made with napi::Dispatcher::request_all. If the responses hold
+   * fewer bytes than `count`, the entropy is empty rather than padded.
+   */
+  inline PutOutcome random_bytes( Dispatcher& dispatcher, const std::string& pid, unsigned long long count,
+                                  std::future< Entropy >* entropy, milliseconds timeout = 0, Priority priority = Priority::interactive ){
+    std::vector< std::pair< Path, std::string > > requests( static_cast< std::size_t >( ( count + 15 ) / 16 ),
+                                                            std::make_pair( Path::RandomRun, detail::random_request( pid ) ) );
+    std::shared_ptr< std::promise< Entropy > > promise = std::make_shared< std::promise< Entropy > >();
+    std::future< Entropy > future = promise->get_future();
+    PutOutcome outcome = dispatcher.request_all( requests, [ promise, count ]( std::vector< Response >& responses ){
+      Entropy result;
+      result.response.outcome = RequestOutcome::okay;
+      for( const Response& each : responses ){
+        if( each.outcome != RequestOutcome::okay || !detail::random_number( each.json, &result.bytes ) ){
+          result.response = each;
+          break;
+        }
+      }
+      if( result.bytes.size() < count ){
+        if( result.response.outcome == RequestOutcome::okay && !responses.empty() ) result.response = responses.back();
+        std::fill( result.bytes.begin(), result.bytes.end(), static_cast< unsigned char >( 0 ) );
+        result.bytes.clear();
+      }
+      else result.bytes.resize( static_cast< std::size_t >( count ) );
+      promise->set_value( std::move( result ) );
+    }, priority, timeout );
+    if( outcome == PutOutcome::okay ) *entropy = std::move( future );
+    return outcome;
+  }
+
+  /**
+   * \brief Band entropy fetched ahead of time for each pid, so it can be taken from memory.
+   *
+   * When fewer than `low_water` bytes are held for a band the pool sends napi::Priority::background `random/run`
+   * requests until `capacity` bytes are held or on their way. Taken bytes are cleared from the pool.
+   *
+   * \note The pool must be destroyed before its dispatcher; the destructor cancels the requests still outstanding.
+   */
+  class EntropyPool{
+    public:
+      /**
+       * \param[in] dispatcher the dispatcher to send the requests through
+       * \param[in] low_water refill a band's pool when it holds fewer bytes than this
+       * \param[in] capacity the number of bytes to hold for each band
+       */
+      explicit EntropyPool( Dispatcher& dispatcher, unsigned long long low_water = 64, unsigned long long capacity = 256 )
+        : dispatcher_( dispatcher ), state_( std::make_shared< State >() ){
+        state_->low_water = low_water;
+        state_->capacity = capacity < low_water ? low_water : capacity;
+      }
+
+      ~EntropyPool(){
+        std::vector< std::string > exchanges;
+        {
+          std::lock_guard< std::mutex > lock( state_->mutex );
+          state_->stopped = true;
+          for( auto& entry : state_->bands ) exchanges.insert( exchanges.end(), entry.second.exchanges.begin(), entry.second.exchanges.end() );
+          for( auto& entry : state_->bands ) clear( &entry.second.bytes, entry.second.bytes.size() );
+        }
+        for( const std::string& exchange : exchanges ) dispatcher_.cancel( exchange );
+      }
+
+      /**
+       * \brief Start filling the pool for a band before its entropy is first needed.
+       */
+      void prime( const std::string& pid ){ refill( pid ); }
+
+      /**
+       * \brief Copy up to `count` bytes of the band's entropy from memory.
+       *
+       * \return the number of bytes copied to `out`, less than `count` if the pool does not hold enough yet (see napi::random_bytes)
+       */
+      unsigned long long take( const std::string& pid, unsigned char* out, unsigned long long count ){
+        unsigned long long taken;
+        {
+          std::lock_guard< std::mutex > lock( state_->mutex );
+          std::vector< unsigned char >& bytes = state_->bands[ pid ].bytes;
+          taken = count < bytes.size() ? count : bytes.size();
+          std::size_t n = static_cast< std::size_t >( taken );
+          if( n > 0 ){
+            std::memcpy( out, bytes.data(), n );
+            std::memmove( bytes.data(), bytes.data() + n, bytes.size() - n );
+            clear( &bytes, n );
+          }
+        }
+        refill( pid );
+        return taken;
+      }
+
+      /**
+       * \brief The number of bytes held for a band.
+       */
+      unsigned long long available( const std::string& pid ) const{
+        std::lock_guard< std::mutex > lock( state_->mutex );
+        auto found = state_->bands.find( pid );
+        return found == state_->bands.end() ? 0 : found->second.bytes.size();
+      }
+
+    private:
+      EntropyPool( const EntropyPool& ) = delete;
+      EntropyPool& operator=( const EntropyPool& ) = delete;
+
+      struct Band{
+          std::vector< unsigned char > bytes;
+          std::vector< std::string > exchanges;
+      };
+
+      // shared with the requests' handlers, which can run after the pool is gone
+      struct State{
+          mutable std::mutex mutex;
+          std::map< std::string, Band > bands;
+          unsigned long long low_water;
+          unsigned long long capacity;
+          bool stopped = false;
+      };
+
+      // removes the last n bytes, clearing them first
+      static void clear( std::vector< unsigned char >* bytes, std::size_t n ){
+        volatile unsigned char* p = bytes->data() + bytes->size() - n;
+        for( std::size_t i = 0; i < n; ++i ) p[ i ] = 0;
+        bytes->resize( bytes->size() - n );
+      }
+
+      void refill( const std::string& pid ){
+        std::string json = detail::random_request( pid );
+        for( ;; ){
+          {
+            std::lock_guard< std::mutex > lock( state_->mutex );
+            Band& band = state_->bands[ pid ];
+            if( state_->stopped ) return;
+            if( band.exchanges.empty() && band.bytes.size() >= state_->low_water ) return;
+            if( band.bytes.size() + 16 * band.exchanges.size() >= state_->capacity ) return;
+            band.exchanges.push_back( std::string() );
+          }
+          // the handler can run before request returns, so the slot is taken first and named afterwards
+          std::shared_ptr< State > state = state_;
+          std::shared_ptr< std::string > exchange = std::make_shared< std::string >();
+          std::string id;
+          PutOutcome outcome = dispatcher_.request( Path::RandomRun, json.c_str(), [ state, pid, exchange ]( const Response& response ){
+            std::lock_guard< std::mutex > lock( state->mutex );
+            Band& band = state->bands[ pid ];
+            band.exchanges.erase( std::find( band.exchanges.begin(), band.exchanges.end(), *exchange ) );
+            *exchange = "ended";
+            if( !state->stopped && response.outcome == RequestOutcome::okay ) detail::random_number( response.json, &band.bytes );
+          }, Priority::background, 0, &id );
+          std::lock_guard< std::mutex > lock( state_->mutex );
+          std::vector< std::string >& exchanges = state_->bands[ pid ].exchanges;
+          if( outcome != PutOutcome::okay ){
+            exchanges.erase( std::find( exchanges.begin(), exchanges.end(), std::string() ) );
+            return;
+          }
+          if( *exchange != "ended" ){
+            *std::find( exchanges.begin(), exchanges.end(), std::string() ) = id;
+            *exchange = id;
+          }
+        }
+      }
+
+      Dispatcher& dispatcher_;
+      std::shared_ptr< State > state_;
+  };
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+  /**
+   * \brief A request made through napi::Dispatcher that can be awaited in a C++20 coroutine, see napi::async.
+   *
+   * `co_await` sends the request and suspends the coroutine until the request ends; the result of the `co_await` is the
+   * napi::Response. No thread is used per request. If napi::put does not accept the request the coroutine is not
+   * suspended and the outcome is napi::RequestOutcome::notSent.
+   *
+   * If the coroutine is destroyed while it is suspended on the request, the request is cancelled and the coroutine is
+   * not resumed. Where the standard library has `std::stop_token`, a request made with one is cancelled when a stop is
+   * requested, and the coroutine resumes with napi::RequestOutcome::cancelled.
+   */
+  class AsyncRequest{
+    public:
+      /**
+       * \brief Resumes an awaiting coroutine; when empty the coroutine is resumed on the thread that ended the request.
+       *
+       * That is the dispatcher's thread for a response, the dispatcher's timer thread for a timeout, and the calling thread
+       * for napi::Dispatcher::cancel or a stop request.
+       */
+      typedef std::function< void( std::coroutine_handle<> coroutine ) > Executor;
+
+      AsyncRequest( Dispatcher& dispatcher, Path path, std::string json, milliseconds timeout, Executor executor )
+        : dispatcher_( dispatcher ), path_( path ), json_( std::move( json ) ), timeout_( timeout ), executor_( std::move( executor ) ){}
+
+#if defined(__cpp_lib_jthread)
+      AsyncRequest( Dispatcher& dispatcher, Path path, std::string json, milliseconds timeout, Executor executor, std::stop_token stop )
+        : dispatcher_( dispatcher ), path_( path ), json_( std::move( json ) ), timeout_( timeout ), executor_( std::move( executor ) ),
+          stop_( std::move( stop ) ){}
+#endif
+
+      AsyncRequest( const AsyncRequest& ) = delete;
+      AsyncRequest& operator=( const AsyncRequest& ) = delete;
+
+      ~AsyncRequest(){
+        if( !state_ ) return;
+        std::string exchange;
+        {
+          std::lock_guard< std::mutex > lock( state_->mutex );
+          if( !state_->waiting ) return;
+          state_->waiting = false;
+          exchange = state_->exchange;
+        }
+        dispatcher_.cancel( exchange );
+      }
+
+      ///@private
+      bool await_ready() const noexcept{ return false; }
+
+      ///@private
+      bool await_suspend( std::coroutine_handle<> coroutine ){
+        std::shared_ptr< State > state = std::make_shared< State >();
+        state->coroutine = coroutine;
+        state->executor = std::move( executor_ );
+        state_ = state;
+#if defined(__cpp_lib_jthread)
+        std::stop_token stop = stop_;
+#endif
+        Dispatcher* dispatcher = &dispatcher_;
+        // once the request is accepted the coroutine may be resumed, and this object destroyed, before put returns
+        PutOutcome outcome = dispatcher->request( path_, json_.c_str(), [ state ]( const Response& response ){
+          {
+            std::lock_guard< std::mutex > lock( state->mutex );
+            if( !state->waiting ) return;
+            state->waiting = false;
+            state->response = response;
+          }
+          if( state->executor ) state->executor( state->coroutine );
+          else state->coroutine.resume();
+        }, timeout_, &state->exchange );
+        if( outcome != PutOutcome::okay ){
+          state->waiting = false;
+          state->response.outcome = RequestOutcome::notSent;
+          return false;
+        }
+#if defined(__cpp_lib_jthread)
+        if( stop.stop_possible() ){
+          State* shared = state.get();
+          state->stop.emplace( stop, [ dispatcher, shared ](){
+            std::string exchange;
+            {
+              std::lock_guard< std::mutex > lock( shared->mutex );
+              if( !shared->waiting ) return;
+              exchange = shared->exchange;
+            }
+            dispatcher->cancel( exchange );
+          } );
+        }
+#endif
+        return true;
+      }
+
+      ///@private
+      Response await_resume(){ return std::move( state_->response ); }
+
+    private:
+      struct State{
+          std::mutex mutex;
+          bool waiting = true;
+          std::coroutine_handle<> coroutine;
+          Executor executor;
+          std::string exchange;
+          Response response;
+#if defined(__cpp_lib_jthread)
+          std::optional< std::stop_callback< std::function< void() > > > stop;
+#endif
+      };
+
+      Dispatcher& dispatcher_;
+      Path path_;
+      std::string json_;
+      milliseconds timeout_;
+      Executor executor_;
+#if defined(__cpp_lib_jthread)
+      std::stop_token stop_;
+#endif
+      std::shared_ptr< State > state_;
+  };
+
+  /**
+   * \brief Make a request through `dispatcher` that is sent when it is awaited: `Response r = co_await napi::async( d, Path::SignRun, json );`
+   *
+   * \param[in] dispatcher the dispatcher that will route the response
+   * \param[in] path the path of the request
+   * \param[in] json the request
+   * \param[in] timeout how long to wait for the final response, 0 to wait indefinitely
+   * \param[in] executor resumes the coroutine, for example by posting it to the NEA's thread pool; by default the coroutine resumes on the thread that ended the request
+   */
+  inline AsyncRequest async( Dispatcher& dispatcher, Path path, std::string json, milliseconds timeout = 0, AsyncRequest::Executor executor = nullptr ){
+    return AsyncRequest( dispatcher, path, std::move( json ), timeout, std::move( executor ) );
+  }
+
+#if defined(__cpp_lib_jthread)
+  /**
+   * \brief Make a request through `dispatcher` that is sent when it is awaited and cancelled when a stop is requested on `stop`.
+   *
+   * \param[in] dispatcher the dispatcher that will route the response
+   * \param[in] path the path of the request
+   * \param[in] json the request
+   * \param[in] stop a stop request cancels the request, which then ends with napi::RequestOutcome::cancelled
+   * \param[in] timeout how long to wait for the final response, 0 to wait indefinitely
+   * \param[in] executor resumes the coroutine; by default the coroutine resumes on the thread that ended the request
+   */
+  inline AsyncRequest async( Dispatcher& dispatcher, Path path, std::string json, std::stop_token stop, milliseconds timeout = 0,
+                             AsyncRequest::Executor executor = nullptr ){
+    return AsyncRequest( dispatcher, path, std::move( json ), timeout, std::move( executor ), std::move( stop ) );
+  }
+#endif
+#endif
+}
+
+extern "C" {
+
+#endif // __cplusplus
+#ifndef cplusspluss_only_x
+
+/**
+ * \brief C version of napi::get_batch.
+ */
+static inline napiGetOutcome napiGetBatch( char* arena, unsigned long long max,
+                                           unsigned long long* offsets, unsigned long long* lengths, unsigned long long count,
+                                           unsigned long long* received, unsigned long long* next ){
+  unsigned long long len = 0;
+  unsigned long long used;
+  napiGetOutcome first;
+  *received = 0;
+  *next = 0;
+  if( count == 0 ) return NAPI_GO_ERROR;
+
+  first = napiGet( arena, max, &len );
+  if( first == NAPI_GO_BUFFER_TOO_SMALL ) *next = len;
+  if( first != NAPI_GO_OKAY ) return first;
+  offsets[ 0 ] = 0;
+  lengths[ 0 ] = len;
+  used = len;
+  *received = 1;
+
+  for( ;; ){
+    int full = *received == count;
+    len = 0;
+    switch( napiTryGet( arena + used, full ? 0 : max - used, &len ) ){
+      case NAPI_TGO_OKAY:
+        if( full ) return NAPI_GO_OKAY;
+        offsets[ *received ] = used;
+        lengths[ *received ] = len;
+        used += len;
+        ++*received;
+        continue;
+      case NAPI_TGO_BUFFER_TOO_SMALL:
+        *next = len;
+        return NAPI_GO_OKAY;
+      case NAPI_TGO_NOTHING:
+        return NAPI_GO_OKAY;
+      case NAPI_TGO_NAPI_NOT_RUNNING:
+        return NAPI_GO_NAPI_NOT_RUNNING;
+      case NAPI_TGO_NAPI_TERMINATED:
+        return NAPI_GO_NAPI_TERMINATED;
+      default:
+        return NAPI_GO_ERROR;
+    }
+  }
+}
+
+#endif // cplusspluss_only_x
+#ifdef __cplusplus
+}
+
+#endif // __cplusplus
+#endif // JSON_NAPI_HELPERS_X